@@ -4,13 +4,26 @@
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <climits>
+#include <charconv>
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
+#include <exception>
+#include <functional>
+#include <iterator>
 #include <memory>
 #include <optional>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 namespace ASTImpl {
 
@@ -69,294 +82,1203 @@ namespace ASTImpl {
 		/* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 	};
 
-	class Expr {
+	// Ошибка: результат арифметической операции не является конечным числом
+	const FormulaError ARITHMETIC_ERROR{ FormulaError::Category::Arithmetic };
+
+	// Проверяет результат арифметической операции
+	ExecResult CheckFinite(double value) {
+		if (!std::isfinite(value)) {
+			return ARITHMETIC_ERROR;
+		}
+		return value;
+	}
+
+	// Значение ячейки как операнда формулы: ошибка передаётся дальше,
+	// текст, не приводимый к числу, — #VALUE!
+	ExecResult ToOperand(const CellInterface::Value& value) {
+		if (std::holds_alternative<double>(value)) {
+			return CheckFinite(std::get<double>(value));
+		}
+		else if (std::holds_alternative<FormulaError>(value)) {
+			return std::get<FormulaError>(value);
+		}
+
+		return FormulaError(FormulaError::Category::Value);
+	}
+
+	// Значение ячейки как операнда формулы: пустая ячейка — ноль,
+	// ошибка передаётся дальше, текст, не приводимый к числу, — #VALUE!
+	ExecResult ReadCell(const SheetInterface& sheet, Position pos) {
+		if (!pos.IsValid()) {
+			return FormulaError(FormulaError::Category::Ref);
+		}
+
+		const CellInterface* cell = sheet.GetCell(pos);
+		if (!cell) {
+			return 0.0;
+		}
+
+		return ToOperand(cell->GetValue());
+	}
+
+	// Дописывает в buffer числа из непустых ячеек диапазона, по строкам.
+	// Первая же ошибка прерывает сбор, и дописанное снимается
+	std::optional<FormulaError> GatherRange(const SheetInterface& sheet, CellRange range, std::vector<double>& buffer) {
+		const size_t begin = buffer.size();
+		for (int row = range.first.row; row <= range.last.row; ++row) {
+			for (int col = range.first.col; col <= range.last.col; ++col) {
+				const CellInterface* cell = sheet.GetCell(Position{ row, col });
+				if (!cell || cell->IsEmpty()) {
+					continue;
+				}
+				ExecResult value = ToOperand(cell->GetValue());
+				if (std::holds_alternative<FormulaError>(value)) {
+					buffer.resize(begin);
+					return std::get<FormulaError>(value);
+				}
+				buffer.push_back(std::get<double>(value));
+			}
+		}
+		return std::nullopt;
+	}
+
+	/*
+	 * Аргументы и диапазоны одного вызова FormulaAST::Execute(sheet, shift)
+	 * в стеках потока: вызов не выделяет память, когда стеки разрослись.
+	 * Чтение ячейки может вычислить другую формулу, и её вложенный Execute
+	 * кладёт свои значения поверх и снимает их до возврата (деструктор —
+	 * и при исключении). Пока стеки растут, указатели на них не раздаются.
+	 */
+	class ExecuteFrame {
 	public:
-		virtual ~Expr() = default;
-		virtual void Print(std::ostream& out) const = 0;
-		virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-		virtual double Evaluate(const SheetInterface& sheet) const = 0;
+		ExecuteFrame()
+			: stacks_(GetStacks())
+			, args_begin_(stacks_.args.size())
+			, values_begin_(stacks_.values.size())
+			, ranges_begin_(stacks_.ranges.size()) {
+		}
 
-		// higher is tighter
-		virtual ExprPrecedence GetPrecedence() const = 0;
+		ExecuteFrame(const ExecuteFrame&) = delete;
+		ExecuteFrame& operator=(const ExecuteFrame&) = delete;
+
+		~ExecuteFrame() {
+			stacks_.args.resize(args_begin_);
+			stacks_.values.resize(values_begin_);
+			stacks_.ranges.resize(ranges_begin_);
+		}
+
+		void AddArgument(const ExecResult& value) {
+			stacks_.args.push_back(value);
+		}
+
+		void AddRange(const SheetInterface& sheet, CellRange range) {
+			const size_t begin = stacks_.values.size();
+			RangeValues values;
+			values.error = GatherRange(sheet, range, stacks_.values);
+			values.count = stacks_.values.size() - begin;
+			stacks_.ranges.push_back(values);
+		}
+
+		const ExecResult* GetArguments() const {
+			return stacks_.args.data() + args_begin_;
+		}
+
+		// Значения диапазонов лежат подряд в порядке AddRange: указатели
+		// на них проставляются здесь, после последнего AddRange
+		const RangeValues* GetRanges() {
+			const double* values = stacks_.values.data() + values_begin_;
+			for (size_t i = ranges_begin_; i < stacks_.ranges.size(); ++i) {
+				stacks_.ranges[i].values = values;
+				values += stacks_.ranges[i].count;
+			}
+			return stacks_.ranges.data() + ranges_begin_;
+		}
+
+	private:
+		struct Stacks {
+			std::vector<ExecResult> args;
+			std::vector<double> values;
+			std::vector<RangeValues> ranges;
+		};
+
+		static Stacks& GetStacks() {
+			thread_local Stacks stacks;
+			return stacks;
+		}
+
+	private:
+		Stacks& stacks_;
+		const size_t args_begin_;
+		const size_t values_begin_;
+		const size_t ranges_begin_;
+	};
+
+	struct FunctionName {
+		std::string_view name;
+		Function function;
+	};
+
+	constexpr FunctionName FUNCTION_NAMES[] = {
+		{ "SUM", Function::Sum },
+		{ "AVERAGE", Function::Average },
+		{ "MIN", Function::Min },
+		{ "MAX", Function::Max },
+		{ "COUNT", Function::Count },
+	};
 
-		void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
+	std::string_view GetFunctionName(Function function) {
+		for (const auto& [name, value] : FUNCTION_NAMES) {
+			if (value == function) {
+				return name;
+			}
+		}
+		assert(false);
+		return {};
+	}
+
+	// Имя должно быть одним из FUNCTION_NAMES: так его разбирает лексер
+	Function GetFunction(std::string_view name) {
+		for (const auto& [function_name, function] : FUNCTION_NAMES) {
+			if (function_name == name) {
+				return function;
+			}
+		}
+		assert(false);
+		return Function::Sum;
+	}
+
+	/*
+	 * Ядра агрегатных функций над непрерывным массивом.
+	 * LANES независимых накопителей разрывают цепочку зависимостей между
+	 * итерациями, и компилятор раскладывает их по векторным регистрам
+	 * (SSE2/AVX/NEON — в зависимости от целевой архитектуры).
+	 * Порядок сложений в SumKernel поэтому отличается от последовательного,
+	 * и сумма может разойтись с цепочкой A1+A2+... в последних битах.
+	 * Значения в массивах конечны.
+	 */
+	constexpr std::size_t LANES = 8;
+
+	double SumKernel(const double* values, std::size_t count) {
+		double lanes[LANES] = {};
+		std::size_t i = 0;
+		for (; i + LANES <= count; i += LANES) {
+			for (std::size_t k = 0; k < LANES; ++k) {
+				lanes[k] += values[i + k];
+			}
+		}
+		double sum = 0;
+		for (std::size_t k = 0; k < LANES; ++k) {
+			sum += lanes[k];
+		}
+		for (; i < count; ++i) {
+			sum += values[i];
+		}
+		return sum;
+	}
+
+	// count > 0
+	template <typename Select>
+	double ReduceKernel(const double* values, std::size_t count, Select select) {
+		double lanes[LANES];
+		for (std::size_t k = 0; k < LANES; ++k) {
+			lanes[k] = values[0];
+		}
+		std::size_t i = 0;
+		for (; i + LANES <= count; i += LANES) {
+			for (std::size_t k = 0; k < LANES; ++k) {
+				lanes[k] = select(lanes[k], values[i + k]);
+			}
+		}
+		double result = lanes[0];
+		for (std::size_t k = 1; k < LANES; ++k) {
+			result = select(result, lanes[k]);
+		}
+		for (; i < count; ++i) {
+			result = select(result, values[i]);
+		}
+		return result;
+	}
+
+	double MinKernel(const double* values, std::size_t count) {
+		return ReduceKernel(values, count, [](double lhs, double rhs) {
+			return rhs < lhs ? rhs : lhs;
+			});
+	}
+
+	double MaxKernel(const double* values, std::size_t count) {
+		return ReduceKernel(values, count, [](double lhs, double rhs) {
+			return lhs < rhs ? rhs : lhs;
+			});
+	}
+
+	/*
+	 * Накопитель аргументов функции: выражения добавляются по одному,
+	 * диапазоны — массивами. Ошибки аргументов сюда не попадают:
+	 * их возвращает вызывающий код до накопления.
+	 */
+	class Accumulator {
+	public:
+		explicit Accumulator(Function function)
+			: function_(function) {
+		}
+
+		void Add(const double* values, std::size_t count) {
+			if (count == 0) {
+				return;
+			}
+			switch (function_) {
+			case Function::Sum:
+			case Function::Average:
+				value_ += SumKernel(values, count);
+				break;
+			case Function::Min: {
+				const double min = MinKernel(values, count);
+				value_ = count_ == 0 || min < value_ ? min : value_;
+				break;
+			}
+			case Function::Max: {
+				const double max = MaxKernel(values, count);
+				value_ = count_ == 0 || value_ < max ? max : value_;
+				break;
+			}
+			case Function::Count:
+				break;
+			}
+			count_ += count;
+		}
+
+		// SUM без чисел — ноль, AVERAGE — деление на ноль, MIN и MAX — ноль
+		ExecResult GetResult() const {
+			switch (function_) {
+			case Function::Sum:
+				return CheckFinite(value_);
+			case Function::Average:
+				if (count_ == 0) {
+					return ARITHMETIC_ERROR;
+				}
+				return CheckFinite(value_ / static_cast<double>(count_));
+			case Function::Min:
+			case Function::Max:
+				return CheckFinite(value_);
+			case Function::Count:
+				return static_cast<double>(count_);
+			}
+			assert(false);
+			return 0.0;
+		}
+
+	private:
+		Function function_;
+		double value_ = 0;
+		std::size_t count_ = 0;
+	};
+
+	enum class NodeType : std::uint8_t {
+		Number,
+		Cell,
+		Range,     // только аргумент функции: его значения читает вызов
+		UnaryOp,
+		BinaryOp,
+		Call,
+	};
+
+	// Нет узла: конец списка аргументов функции
+	constexpr std::uint32_t NO_NODE = UINT32_MAX;
+
+	/*
+	 * Узел дерева формулы. Все узлы формулы лежат подряд в одном массиве,
+	 * дети — раньше родителя, так что корень — последний узел.
+	 * Связи — номера узлов в массиве; позиция ячейки хранится в самом узле,
+	 * поэтому отдельного списка ссылок не нужно.
+	 */
+	struct Node {
+		explicit Node(NodeType node_type)
+			: type(node_type) {
+		}
+
+		NodeType type;
+		char op = 0;                      ///< Оператор UnaryOp и BinaryOp: + - * /
+		Function function = Function::Sum;  ///< Функция Call
+		std::uint32_t lhs = NO_NODE;      ///< Операнд UnaryOp, левый операнд BinaryOp, первый аргумент Call
+		std::uint32_t rhs = NO_NODE;      ///< Правый операнд BinaryOp
+		std::uint32_t next = NO_NODE;     ///< Следующий аргумент той же функции
+
+		union Payload {
+			double number;
+			Position cell;
+			CellRange range;
+
+			Payload()
+				: number(0) {
+			}
+		} payload;
+	};
+
+	// Отводит место под count элементов T в конце блока размера size
+	template <typename T>
+	BlockArray ReserveArray(std::size_t& size, std::size_t count) {
+		static_assert(std::is_trivially_copyable_v<T> && std::is_trivially_destructible_v<T>,
+			"блок формулы освобождается без деструкторов элементов");
+		static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__, "блок выровнен не сильнее");
+		size = (size + alignof(T) - 1) / alignof(T) * alignof(T);
+		assert(size + count * sizeof(T) <= UINT32_MAX);
+		const BlockArray array{ static_cast<std::uint32_t>(size), static_cast<std::uint32_t>(count) };
+		size += count * sizeof(T);
+		return array;
+	}
+
+	template <typename T>
+	void StoreArray(std::byte* block, BlockArray array, const T* values) {
+		std::uninitialized_copy_n(values, array.size, reinterpret_cast<T*>(block + array.offset));
+	}
+
+	/*
+	 * Байткод формулы во время сборки. Массивы копятся в буферах потока,
+	 * а формула получает их копии в своём блоке (см. FormulaAST).
+	 * Аргументы и диапазоны — в порядке вхождений; после компиляции их
+	 * упорядочивают без повторов в unique_arguments и unique_ranges
+	 */
+	struct Program {
+		std::vector<Instruction> code;
+		std::vector<double> constants;
+		std::vector<Position> arguments;
+		std::vector<CellRange> ranges;
+		std::vector<Call> calls;
+		std::vector<std::uint32_t> call_ranges;
+		std::vector<Position> unique_arguments;
+		std::vector<CellRange> unique_ranges;
+
+		// Очищенные буферы потока
+		static Program& GetBuffer() {
+			thread_local Program program;
+			program.code.clear();
+			program.constants.clear();
+			program.arguments.clear();
+			program.ranges.clear();
+			program.calls.clear();
+			program.call_ranges.clear();
+			program.unique_arguments.clear();
+			program.unique_ranges.clear();
+			return program;
+		}
+	};
+
+	/*
+	 * Обход дерева формулы, заданного массивом узлов
+	 */
+	class Tree {
+	public:
+		explicit Tree(ArrayView<Node> nodes)
+			: nodes_(nodes) {
+		}
+
+		std::uint32_t GetRoot() const {
+			assert(!nodes_.empty());
+			return static_cast<std::uint32_t>(nodes_.size() - 1);
+		}
+
+		void Print(std::ostream& out, std::uint32_t index) const {
+			const Node& node = nodes_[index];
+			switch (node.type) {
+			case NodeType::Number:
+				out << node.payload.number;
+				break;
+			case NodeType::Cell: {
+				std::string text;
+				PrintPosition(text, node.payload.cell);
+				out << text;
+				break;
+			}
+			case NodeType::Range:
+				out << node.payload.range.ToString();
+				break;
+			case NodeType::UnaryOp:
+				out << '(' << node.op << ' ';
+				Print(out, node.lhs);
+				out << ')';
+				break;
+			case NodeType::BinaryOp:
+				out << '(' << node.op << ' ';
+				Print(out, node.lhs);
+				out << ' ';
+				Print(out, node.rhs);
+				out << ')';
+				break;
+			case NodeType::Call:
+				out << '(' << GetFunctionName(node.function);
+				for (std::uint32_t arg = node.lhs; arg != NO_NODE; arg = nodes_[arg].next) {
+					out << ' ';
+					Print(out, arg);
+				}
+				out << ')';
+				break;
+			}
+		}
+
+		// Дописывает к out выражение со ссылками, сдвинутыми на shift.
+		// Пишет прямо в строку, без потока
+		void PrintFormula(std::string& out, std::uint32_t index, ExprPrecedence parent_precedence, Position shift,
 			bool right_child = false) const {
-			auto precedence = GetPrecedence();
+			auto precedence = GetPrecedence(nodes_[index]);
 			auto mask = right_child ? PR_RIGHT : PR_LEFT;
 			bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
 			if (parens_needed) {
-				out << '(';
+				out += '(';
 			}
 
-			DoPrintFormula(out, precedence);
+			DoPrintFormula(out, index, precedence, shift);
 
 			if (parens_needed) {
-				out << ')';
+				out += ')';
 			}
 		}
-	};
 
-	/*
-	 * Обработка бинарных операций
-	 */
-	class BinaryOpExpr final : public Expr {
-	public:
-		enum Type : char {
-			Add = '+',
-			Subtract = '-',
-			Multiply = '*',
-			Divide = '/',
-		};
+		ExecResult Evaluate(const SheetInterface& sheet, std::uint32_t index) const {
+			const Node& node = nodes_[index];
+			switch (node.type) {
+			case NodeType::Number:
+				return CheckFinite(node.payload.number);
+			case NodeType::Cell:
+				return ReadCell(sheet, node.payload.cell);
+			case NodeType::Range:
+				assert(false && "Range is evaluated by the enclosing function");
+				return FormulaError(FormulaError::Category::Value);
+			case NodeType::UnaryOp:
+				return EvaluateUnary(sheet, node);
+			case NodeType::BinaryOp:
+				return EvaluateBinary(sheet, node);
+			case NodeType::Call:
+				return EvaluateCall(sheet, node);
+			}
+			assert(false);
+			return 0.0;
+		}
+
+		// Дописывает в программу команды, вычисляющие выражение.
+		// Номера аргументов и диапазонов пока равны номерам вхождений;
+		// после компиляции ссылки упорядочиваются и номера пересчитываются
+		void Compile(Program& program, std::uint32_t index) const {
+			const Node& node = nodes_[index];
+			switch (node.type) {
+			case NodeType::Number:
+				program.code.push_back({ OpCode::PushNumber, static_cast<std::uint32_t>(program.constants.size()) });
+				program.constants.push_back(node.payload.number);
+				break;
+			case NodeType::Cell:
+				program.code.push_back({ OpCode::LoadCell, static_cast<std::uint32_t>(program.arguments.size()) });
+				program.arguments.push_back(node.payload.cell);
+				break;
+			case NodeType::Range:
+				assert(false && "Range is compiled by the enclosing function");
+				break;
+			case NodeType::UnaryOp:
+				Compile(program, node.lhs);
+				// Унарный плюс значения не меняет: операнды всегда конечны
+				if (node.op == '-') {
+					program.code.push_back({ OpCode::Negate });
+				}
+				break;
+			case NodeType::BinaryOp:
+				Compile(program, node.lhs);
+				Compile(program, node.rhs);
+				program.code.push_back({ GetBinaryOpCode(node.op) });
+				break;
+			case NodeType::Call: {
+				// Выражения кладут значения на стек, диапазоны передаются номерами.
+				// Номера диапазонов вызова занимают место в call_ranges заранее:
+				// вложенные вызовы аргументов допишут свои следом
+				Call call{ node.function, 0, static_cast<std::uint32_t>(program.call_ranges.size()), 0 };
+				for (std::uint32_t arg = node.lhs; arg != NO_NODE; arg = nodes_[arg].next) {
+					call.range_count += nodes_[arg].type == NodeType::Range;
+				}
+				program.call_ranges.resize(program.call_ranges.size() + call.range_count);
+				std::uint32_t call_range = call.ranges_begin;
+				for (std::uint32_t arg = node.lhs; arg != NO_NODE; arg = nodes_[arg].next) {
+					if (nodes_[arg].type == NodeType::Range) {
+						const auto range = static_cast<std::uint32_t>(program.ranges.size());
+						program.code.push_back({ OpCode::CheckRange, range });
+						program.call_ranges[call_range++] = range;
+						program.ranges.push_back(nodes_[arg].payload.range);
+					}
+					else {
+						Compile(program, arg);
+						++call.scalar_count;
+					}
+				}
+				program.code.push_back({ OpCode::Call, static_cast<std::uint32_t>(program.calls.size()) });
+				program.calls.push_back(call);
+				break;
+			}
+			}
+		}
+
+		// Ячейки в порядке, обратном порядку их появления в тексте
+		void PrintCells(std::ostream& out) const {
+			for (std::size_t index = nodes_.size(); index-- > 0;) {
+				if (nodes_[index].type == NodeType::Cell) {
+					out << nodes_[index].payload.cell.ToString() << ' ';
+				}
+			}
+		}
 
 	private:
-		Type type_;                 ///< Оператор
-		std::unique_ptr<Expr> lhs_; ///< Левый операнд
-		std::unique_ptr<Expr> rhs_; ///< Правый операнд
+		// higher is tighter
+		static ExprPrecedence GetPrecedence(const Node& node) {
+			switch (node.type) {
+			case NodeType::UnaryOp:
+				return EP_UNARY;
+			case NodeType::BinaryOp:
+				switch (node.op) {
+				case '+':
+					return EP_ADD;
+				case '-':
+					return EP_SUB;
+				case '*':
+					return EP_MUL;
+				case '/':
+					return EP_DIV;
+				default:
+					// have to do this because VC++ has a buggy warning
+					assert(false);
+					return static_cast<ExprPrecedence>(INT_MAX);
+				}
+			default:
+				return EP_ATOM;
+			}
+		}
 
-	public:
-		explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
-			: type_(type)
-			, lhs_(std::move(lhs))
-			, rhs_(std::move(rhs)) {
-		}
-
-		void Print(std::ostream& out) const override {
-			out << '(' << static_cast<char>(type_) << ' ';
-			lhs_->Print(out);
-			out << ' ';
-			rhs_->Print(out);
-			out << ')';
-		}
-
-		void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-			lhs_->PrintFormula(out, precedence);
-			out << static_cast<char>(type_);
-			rhs_->PrintFormula(out, precedence, /* right_child = */ true);
-		}
-
-		ExprPrecedence GetPrecedence() const override {
-			switch (type_) {
-			case Add:
-				return EP_ADD;
-			case Subtract:
-				return EP_SUB;
-			case Multiply:
-				return EP_MUL;
-			case Divide:
-				return EP_DIV;
+		static OpCode GetBinaryOpCode(char op) {
+			switch (op) {
+			case '+':
+				return OpCode::Add;
+			case '-':
+				return OpCode::Subtract;
+			case '*':
+				return OpCode::Multiply;
 			default:
-				// have to do this because VC++ has a buggy warning
-				assert(false);
-				return static_cast<ExprPrecedence>(INT_MAX);
+				assert(op == '/');
+				return OpCode::Divide;
+			}
+		}
+
+		static void PrintPosition(std::string& out, Position pos) {
+			if (!pos.IsValid()) {
+				out += FormulaError(FormulaError::Category::Ref).ToString();
+			}
+			else {
+				PrintAddress(out, pos);
 			}
 		}
 
-		double Evaluate(const SheetInterface& sheet) const override {
-			double lhs_value = lhs_->Evaluate(sheet);
-			double rhs_value = rhs_->Evaluate(sheet);
+		// Адрес корректной ячейки, без промежуточной строки
+		static void PrintAddress(std::string& out, Position pos) {
+			char buffer[Position::MAX_STRING_SIZE];
+			out.append(buffer, pos.ToChars(buffer));
+		}
 
-			if (!std::isfinite(lhs_value) || !std::isfinite(rhs_value)) {
-				throw FormulaError(FormulaError::Category::Arithmetic);
+		// Диапазон как CellRange::ToString(): некорректный не выводится
+		static void PrintRange(std::string& out, CellRange range) {
+			if (range.IsValid()) {
+				PrintAddress(out, range.first);
+				out += ':';
+				PrintAddress(out, range.last);
 			}
+		}
 
-			double result = 0.0;
+		// Число как operator<< потока с настройками по умолчанию (%g,
+		// шесть значащих цифр), но без потока
+		static void PrintNumber(std::string& out, double number) {
+			char buffer[32];
+			const auto result = std::to_chars(buffer, buffer + sizeof(buffer), number, std::chars_format::general, 6);
+			out.append(buffer, result.ptr);
+		}
 
-			switch (type_) {
-			case Add:
-				result = lhs_value + rhs_value;
+		void DoPrintFormula(std::string& out, std::uint32_t index, ExprPrecedence precedence, Position shift) const {
+			const Node& node = nodes_[index];
+			switch (node.type) {
+			case NodeType::Number:
+				PrintNumber(out, node.payload.number);
 				break;
-			case Subtract:
-				result = lhs_value - rhs_value;
+			case NodeType::Cell:
+				PrintPosition(out, ShiftPosition(node.payload.cell, shift));
 				break;
-			case Multiply:
-				result = lhs_value * rhs_value;
+			case NodeType::Range:
+				PrintRange(out, ShiftRange(node.payload.range, shift));
 				break;
-			case Divide:
-				if (rhs_value == 0) {
-					throw FormulaError(FormulaError::Category::Arithmetic);
+			case NodeType::UnaryOp:
+				out += node.op;
+				PrintFormula(out, node.lhs, precedence, shift);
+				break;
+			case NodeType::BinaryOp:
+				PrintFormula(out, node.lhs, precedence, shift);
+				out += node.op;
+				PrintFormula(out, node.rhs, precedence, shift, /* right_child = */ true);
+				break;
+			case NodeType::Call: {
+				out += GetFunctionName(node.function);
+				out += '(';
+				bool first = true;
+				for (std::uint32_t arg = node.lhs; arg != NO_NODE; arg = nodes_[arg].next) {
+					if (!first) {
+						out += ',';
+					}
+					first = false;
+					// Аргументы разделены запятыми: скобки вокруг них не нужны
+					PrintFormula(out, arg, EP_ADD, shift);
 				}
-				result = lhs_value / rhs_value;
+				out += ')';
 				break;
+			}
+			}
+		}
+
+		ExecResult EvaluateUnary(const SheetInterface& sheet, const Node& node) const {
+			ExecResult operand = Evaluate(sheet, node.lhs);
+			if (std::holds_alternative<FormulaError>(operand)) {
+				return operand;
+			}
+
+			const double operand_value = std::get<double>(operand);
+			if (!std::isfinite(operand_value)) {
+				return ARITHMETIC_ERROR;
+			}
+
+			return node.op == '-' ? -operand_value : operand_value;
+		}
+
+		ExecResult EvaluateBinary(const SheetInterface& sheet, const Node& node) const {
+			// Операнды вычисляются слева направо; первая ошибка — результат
+			ExecResult lhs = Evaluate(sheet, node.lhs);
+			if (std::holds_alternative<FormulaError>(lhs)) {
+				return lhs;
+			}
+			ExecResult rhs = Evaluate(sheet, node.rhs);
+			if (std::holds_alternative<FormulaError>(rhs)) {
+				return rhs;
+			}
+
+			const double lhs_value = std::get<double>(lhs);
+			const double rhs_value = std::get<double>(rhs);
+
+			if (!std::isfinite(lhs_value) || !std::isfinite(rhs_value)) {
+				return ARITHMETIC_ERROR;
+			}
+
+			switch (node.op) {
+			case '+':
+				return CheckFinite(lhs_value + rhs_value);
+			case '-':
+				return CheckFinite(lhs_value - rhs_value);
+			case '*':
+				return CheckFinite(lhs_value * rhs_value);
+			case '/':
+				if (rhs_value == 0) {
+					return ARITHMETIC_ERROR;
+				}
+				return CheckFinite(lhs_value / rhs_value);
 			default:
 				assert(false);
 				return 0.0;
 			}
+		}
 
-			if (!std::isfinite(result)) {
-				throw FormulaError(FormulaError::Category::Arithmetic);
+		ExecResult EvaluateCall(const SheetInterface& sheet, const Node& node) const {
+			Accumulator accumulator(node.function);
+			std::vector<double> buffer;
+			for (std::uint32_t arg = node.lhs; arg != NO_NODE; arg = nodes_[arg].next) {
+				if (nodes_[arg].type == NodeType::Range) {
+					buffer.clear();
+					if (const auto error = GatherRange(sheet, nodes_[arg].payload.range, buffer)) {
+						return *error;
+					}
+					accumulator.Add(buffer.data(), buffer.size());
+					continue;
+				}
+				ExecResult value = Evaluate(sheet, arg);
+				if (std::holds_alternative<FormulaError>(value)) {
+					return value;
+				}
+				accumulator.Add(&std::get<double>(value), 1);
 			}
-
-			return result;
+			return accumulator.GetResult();
 		}
+
+	private:
+		ArrayView<Node> nodes_;
 	};
 
 	/*
-	 * Обработка унарных операций
+	 * Сборка дерева формулы: узлы добавляются снизу вверх, каждый — после
+	 * своих детей. Узлы копятся в буфере потока, а формула копирует их
+	 * в свой блок вместе с байткодом: одна аллокация на формулу.
 	 */
-	class UnaryOpExpr final : public Expr {
+	class TreeBuilder {
 	public:
-		enum Type : char {
-			UnaryPlus = '+',
-			UnaryMinus = '-',
-		};
+		TreeBuilder()
+			: nodes_(GetBuffer()) {
+			nodes_.clear();
+		}
 
-	private:
-		Type type_;                     ///< Оператор
-		std::unique_ptr<Expr> operand_; ///< Операнд
+		std::uint32_t AddNumber(double value) {
+			Node node(NodeType::Number);
+			node.payload.number = value;
+			return Add(node);
+		}
 
-	public:
-		explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
-			: type_(type)
-			, operand_(std::move(operand)) {
+		std::uint32_t AddCell(Position pos) {
+			Node node(NodeType::Cell);
+			node.payload.cell = pos;
+			return Add(node);
 		}
 
-		void Print(std::ostream& out) const override {
-			out << '(' << static_cast<char>(type_) << ' ';
-			operand_->Print(out);
-			out << ')';
+		std::uint32_t AddRange(CellRange range) {
+			Node node(NodeType::Range);
+			node.payload.range = range;
+			return Add(node);
 		}
 
-		void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-			out << static_cast<char>(type_);
-			operand_->PrintFormula(out, precedence);
+		// op: '+' или '-'
+		std::uint32_t AddUnaryOp(char op, std::uint32_t operand) {
+			Node node(NodeType::UnaryOp);
+			node.op = op;
+			node.lhs = operand;
+			return Add(node);
 		}
 
-		ExprPrecedence GetPrecedence() const override {
-			return EP_UNARY;
+		// op: '+', '-', '*' или '/'
+		std::uint32_t AddBinaryOp(char op, std::uint32_t lhs, std::uint32_t rhs) {
+			Node node(NodeType::BinaryOp);
+			node.op = op;
+			node.lhs = lhs;
+			node.rhs = rhs;
+			return Add(node);
 		}
 
-		double Evaluate(const SheetInterface& sheet) const override {
-			double operand_value = operand_->Evaluate(sheet);
+		// Аргументы — first и связанные за ним через LinkArgument
+		std::uint32_t AddCall(Function function, std::uint32_t first) {
+			Node node(NodeType::Call);
+			node.function = function;
+			node.lhs = first;
+			return Add(node);
+		}
 
-			if (!std::isfinite(operand_value)) {
-				throw FormulaError(FormulaError::Category::Arithmetic);
-			}
+		// Ставит аргумент next следом за аргументом prev той же функции
+		void LinkArgument(std::uint32_t prev, std::uint32_t next) {
+			nodes_[prev].next = next;
+		}
 
-			double result = operand_value;
+		// Корень добавлен последним: все узлы — его потомки.
+		// Узлы остаются в буфере потока до следующей сборки
+		ArrayView<Node> Finish(std::uint32_t root) const {
+			assert(root + 1 == nodes_.size());
+			return { nodes_.data(), nodes_.size() };
+		}
 
-			if (type_ == UnaryMinus) {
-				result = -result;
-			}
+	private:
+		static std::vector<Node>& GetBuffer() {
+			thread_local std::vector<Node> buffer;
+			return buffer;
+		}
 
-			return result;
+		std::uint32_t Add(const Node& node) {
+			nodes_.push_back(node);
+			return static_cast<std::uint32_t>(nodes_.size() - 1);
 		}
+
+	private:
+		std::vector<Node>& nodes_;
 	};
 
 	/*
-	 * Обработка ячеек
+	 * Разбор формулы без ANTLR: лексер и парсер Пратта по грамматике Formula.g4.
+	 * Лексемы читаются прямо из строки, без промежуточных буферов;
+	 * память выделяется только под узлы дерева.
+	 * Дерево и ошибки совпадают с разбором через ANTLR: синтаксические ошибки
+	 * и ошибки лексера — ParsingError; некорректная ячейка (FormulaException)
+	 * или число (ParsingError) сообщаются, как и там, только для синтаксически
+	 * верной формулы, первыми слева направо.
 	 */
-	class CellExpr final : public Expr {
-	private:
-		const Position* cell_;      ///< Ячейка
-
+	class PrattParser {
 	public:
-		explicit CellExpr(const Position* cell)
-			: cell_(cell) {
+		// text должен оставаться неизменным до конца разбора
+		explicit PrattParser(const std::string& text)
+			: text_(text) {
+			Advance();
+		}
+
+		// Ключ шаблона (см. GetTemplateKey): лексемы через пробел, ячейки —
+		// смещениями от anchor. Синтаксис не проверяется
+		std::optional<std::string> MakeTemplateKey(Position anchor) {
+			std::string key;
+			key.reserve(text_.size() + 16);
+			for (; token_.type != TokenType::End; Advance()) {
+				if (!key.empty()) {
+					key += ' ';
+				}
+				if (token_.type != TokenType::Cell) {
+					key += token_.text;
+					continue;
+				}
+				const Position pos = Position::FromString(token_.text);
+				if (!pos.IsValid()) {
+					return std::nullopt;
+				}
+				// Смещение — пара чисел со знаком, как в записи R1C1
+				if (!AppendOffset(key, 'R', pos.row - anchor.row)
+					|| !AppendOffset(key, 'C', pos.col - anchor.col)) {
+					return std::nullopt;
+				}
+			}
+			return key;
 		}
 
-		void Print(std::ostream& out) const override {
-			if (!cell_->IsValid()) {
-				out << FormulaError::Category::Ref;
+		FormulaAST Parse() {
+			const std::uint32_t root = ParseExpression(0);
+			if (token_.type != TokenType::End) {
+				throw ParsingError("Syntax error in formula");
 			}
-			else {
-				out << cell_->ToString();
+			if (deferred_error_) {
+				std::rethrow_exception(deferred_error_);
 			}
+			return FormulaAST(builder_.Finish(root));
 		}
 
-		void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-			Print(out);
+	private:
+		// Дописывает к key метку и смещение. Возвращает false, если
+		// смещение не удалось записать
+		static bool AppendOffset(std::string& key, char label, int offset) {
+			char digits[16];
+			const auto [end, error] = std::to_chars(std::begin(digits), std::end(digits), offset);
+			if (error != std::errc{}) {
+				return false;
+			}
+			key += label;
+			key.append(digits, end);
+			return true;
 		}
 
-		ExprPrecedence GetPrecedence() const override {
-			return EP_ATOM;
+		enum class TokenType {
+			Number,
+			Cell,
+			Add,
+			Sub,
+			Mul,
+			Div,
+			LeftParen,
+			RightParen,
+			Colon,
+			Comma,
+			Function,
+			End,
+		};
+
+		struct Token {
+			TokenType type = TokenType::End;
+			std::string_view text;
+		};
+
+		// Сила связывания бинарных операторов; 0 — не бинарный оператор.
+		// Унарные операторы связывают сильнее любых бинарных: -A1*B1 == (-A1)*B1
+		static constexpr int ADDITIVE_BINDING = 1;
+		static constexpr int MULTIPLICATIVE_BINDING = 2;
+		static constexpr int UNARY_BINDING = 3;
+
+		static int GetBinding(TokenType type) {
+			switch (type) {
+			case TokenType::Add:
+			case TokenType::Sub:
+				return ADDITIVE_BINDING;
+			case TokenType::Mul:
+			case TokenType::Div:
+				return MULTIPLICATIVE_BINDING;
+			default:
+				return 0;
+			}
+		}
+
+		static bool IsDigit(char c) {
+			return c >= '0' && c <= '9';
+		}
+
+		static bool IsUpper(char c) {
+			return c >= 'A' && c <= 'Z';
 		}
 
-		double Evaluate(const SheetInterface& sheet) const override {
-			if (!cell_->IsValid()) {
-				throw FormulaError(FormulaError::Category::Ref);
+		// Пропускает цифры начиная с pos; возвращает позицию после них
+		size_t SkipDigits(size_t pos) const {
+			while (pos < text_.size() && IsDigit(text_[pos])) {
+				++pos;
 			}
+			return pos;
+		}
 
-			const CellInterface* cell = sheet.GetCell(*cell_);
-			if (!cell) {
-				return 0.0;
+		[[noreturn]] void ThrowLexingError(size_t pos) const {
+			throw ParsingError("Error when lexing: token recognition error at: '"
+				+ std::string(1, text_[pos]) + "'");
+		}
+
+		// Считывает следующую лексему в token_
+		void Advance() {
+			while (pos_ < text_.size()
+				&& (text_[pos_] == ' ' || text_[pos_] == '\t' || text_[pos_] == '\n' || text_[pos_] == '\r')) {
+				++pos_;
+			}
+			if (pos_ == text_.size()) {
+				token_ = { TokenType::End, {} };
+				return;
 			}
 
-			CellInterface::Value value = cell->GetValue();
+			const size_t begin = pos_;
+			const char c = text_[pos_];
+			TokenType type;
+			switch (c) {
+			case '+': type = TokenType::Add; ++pos_; break;
+			case '-': type = TokenType::Sub; ++pos_; break;
+			case '*': type = TokenType::Mul; ++pos_; break;
+			case '/': type = TokenType::Div; ++pos_; break;
+			case '(': type = TokenType::LeftParen; ++pos_; break;
+			case ')': type = TokenType::RightParen; ++pos_; break;
+			case ':': type = TokenType::Colon; ++pos_; break;
+			case ',': type = TokenType::Comma; ++pos_; break;
+			default:
+				if (IsUpper(c)) {
+					type = LexWord();
+				}
+				else if (IsDigit(c) || c == '.') {
+					LexNumber();
+					type = TokenType::Number;
+				}
+				else {
+					ThrowLexingError(begin);
+				}
+			}
+			token_ = { type, text_.substr(begin, pos_ - begin) };
+		}
 
-			if (std::holds_alternative<double>(value)) {
-				double result = std::get<double>(value);
-				if (!std::isfinite(result)) {
-					throw FormulaError(FormulaError::Category::Arithmetic);
+		// CELL: [A-Z]+[0-9]+ либо FUNCTION — одно из имён функций.
+		// Как и лексер ANTLR, выбираем самую длинную подходящую лексему:
+		// SUM1 — ячейка, SUMX — функция SUM, за которой ошибка на X
+		TokenType LexWord() {
+			const size_t begin = pos_;
+			while (pos_ < text_.size() && IsUpper(text_[pos_])) {
+				++pos_;
+			}
+			const size_t digits = pos_;
+			pos_ = SkipDigits(pos_);
+			if (pos_ != digits) {
+				return TokenType::Cell;
+			}
+
+			const std::string_view letters = text_.substr(begin, digits - begin);
+			size_t length = 0;
+			for (const auto& function : FUNCTION_NAMES) {
+				if (function.name.size() > length && letters.substr(0, function.name.size()) == function.name) {
+					length = function.name.size();
 				}
-				return result;
 			}
-			else if (std::holds_alternative<FormulaError>(value)) {
-				throw std::get<FormulaError>(value);
+			if (length == 0) {
+				ThrowLexingError(begin);
 			}
+			pos_ = begin + length;
+			return TokenType::Function;
+		}
 
-			throw FormulaError(FormulaError::Category::Value);
+		// NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?, EXPONENT: [eE] [-+]? UINT.
+		// Неполная дробная часть или экспонента не может быть началом
+		// никакой другой лексемы, поэтому это сразу ошибка лексера
+		void LexNumber() {
+			pos_ = SkipDigits(pos_);
+			if (pos_ < text_.size() && text_[pos_] == '.') {
+				const size_t fraction = pos_ + 1;
+				pos_ = SkipDigits(fraction);
+				if (pos_ == fraction) {
+					ThrowLexingError(fraction - 1);
+				}
+			}
+			if (pos_ < text_.size() && (text_[pos_] == 'e' || text_[pos_] == 'E')) {
+				size_t exponent = pos_ + 1;
+				if (exponent < text_.size() && (text_[exponent] == '+' || text_[exponent] == '-')) {
+					++exponent;
+				}
+				const size_t end = SkipDigits(exponent);
+				if (end == exponent) {
+					ThrowLexingError(pos_);
+				}
+				pos_ = end;
+			}
 		}
-	};
 
-	/*
-	 * Обработка числового выражения
-	 */
-	class NumberExpr final : public Expr {
-	private:
-		double value_;
+		std::uint32_t ParseExpression(int min_binding) {
+			return ParseInfix(ParsePrefix(), min_binding);
+		}
 
-	public:
-		explicit NumberExpr(double value)
-			: value_(value) {
+		// Продолжает разбор выражения с уже разобранным левым операндом
+		std::uint32_t ParseInfix(std::uint32_t lhs, int min_binding) {
+			while (true) {
+				const TokenType op = token_.type;
+				const int binding = GetBinding(op);
+				if (binding <= min_binding) {
+					return lhs;
+				}
+				Advance();
+				// Правый операнд связывает строже: операторы левоассоциативны
+				const std::uint32_t rhs = ParseExpression(binding);
+				lhs = builder_.AddBinaryOp(ToBinaryOp(op), lhs, rhs);
+			}
+		}
+
+		std::uint32_t ParsePrefix() {
+			const Token token = token_;
+			switch (token.type) {
+			case TokenType::Number:
+				Advance();
+				return builder_.AddNumber(ConvertNumber(token.text));
+			case TokenType::Cell:
+				Advance();
+				return AddCell(token.text);
+			case TokenType::LeftParen: {
+				Advance();
+				const std::uint32_t expr = ParseExpression(0);
+				if (token_.type != TokenType::RightParen) {
+					break;
+				}
+				Advance();
+				return expr;
+			}
+			case TokenType::Add:
+			case TokenType::Sub: {
+				Advance();
+				const std::uint32_t operand = ParseExpression(UNARY_BINDING);
+				return builder_.AddUnaryOp(token.type == TokenType::Sub ? '-' : '+', operand);
+			}
+			case TokenType::Function:
+				Advance();
+				if (token_.type == TokenType::LeftParen) {
+					Advance();
+					return ParseCall(GetFunction(token.text));
+				}
+				break;
+			default:
+				break;
+			}
+			throw ParsingError("Syntax error in formula");
+		}
+
+		// Аргументы функции после '(': arg (',' arg)* ')'
+		std::uint32_t ParseCall(Function function) {
+			const std::uint32_t first = ParseArgument();
+			std::uint32_t last = first;
+			while (token_.type == TokenType::Comma) {
+				Advance();
+				const std::uint32_t arg = ParseArgument();
+				builder_.LinkArgument(last, arg);
+				last = arg;
+			}
+			if (token_.type != TokenType::RightParen) {
+				throw ParsingError("Syntax error in formula");
+			}
+			Advance();
+			return builder_.AddCall(function, first);
+		}
+
+		// arg: CELL ':' CELL | expr.
+		// Ячейка в начале аргумента — либо угол диапазона, либо начало выражения
+		std::uint32_t ParseArgument() {
+			if (token_.type != TokenType::Cell) {
+				return ParseExpression(0);
+			}
+			const Token first = token_;
+			Advance();
+			if (token_.type != TokenType::Colon) {
+				return ParseInfix(AddCell(first.text), 0);
+			}
+			Advance();
+			const Token last = token_;
+			if (last.type != TokenType::Cell) {
+				throw ParsingError("Syntax error in formula");
+			}
+			Advance();
+			return builder_.AddRange(MakeRange(first.text, last.text));
 		}
 
-		void Print(std::ostream& out) const override {
-			out << value_;
+		static char ToBinaryOp(TokenType type) {
+			switch (type) {
+			case TokenType::Add: return '+';
+			case TokenType::Sub: return '-';
+			case TokenType::Mul: return '*';
+			default: return '/';
+			}
 		}
 
-		void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-			out << value_;
+		// Преобразует NUMBER так же, как istream >> double в разборе через ANTLR:
+		// переполнение — ошибка, потеря значимости — ноль или денормализованное число
+		double ConvertNumber(std::string_view text) {
+			// Лексема NUMBER — самый длинный префикс, который разобрал бы strtod,
+			// поэтому strtod остановится ровно на её конце
+			const double value = std::strtod(text.data(), nullptr);
+			if (!std::isfinite(value)) {
+				Defer(ParsingError("Invalid number: " + std::string(text)));
+			}
+			return value;
 		}
 
-		ExprPrecedence GetPrecedence() const override {
-			return EP_ATOM;
+		std::uint32_t AddCell(std::string_view text) {
+			const Position pos = Position::FromString(text);
+			if (!pos.IsValid()) {
+				Defer(FormulaException("Invalid cell position: " + std::string(text)));
+			}
+			return builder_.AddCell(pos);
 		}
 
-		double Evaluate(const SheetInterface& sheet) const override {
-			if (!std::isfinite(value_)) {
-				throw FormulaError(FormulaError::Category::Arithmetic);
+		CellRange MakeRange(std::string_view first, std::string_view last) {
+			const Position first_pos = Position::FromString(first);
+			const Position last_pos = Position::FromString(last);
+			for (const auto& [pos, text] : { std::pair{ first_pos, first }, std::pair{ last_pos, last } }) {
+				if (!pos.IsValid()) {
+					Defer(FormulaException("Invalid cell position: " + std::string(text)));
+				}
 			}
+			return CellRange::FromCorners(first_pos, last_pos);
+		}
 
-			return value_;
+		// Запоминает первую смысловую ошибку до конца синтаксического разбора
+		template <typename Exception>
+		void Defer(Exception error) {
+			if (!deferred_error_) {
+				deferred_error_ = std::make_exception_ptr(std::move(error));
+			}
 		}
+
+	private:
+		std::string_view text_;
+		size_t pos_ = 0;
+		Token token_;
+		TreeBuilder builder_;
+		std::exception_ptr deferred_error_;
 	};
 
 	// Глубокая переработка - проблема совместимости моей среды разработки
 	// с тренажёром и коварный тест с "R2D2"
 	class ParseASTListener final : public FormulaBaseListener {
 	public:
-		std::unique_ptr<Expr> MoveRoot() {
+		ArrayView<Node> GetNodes() const {
 			assert(args_.size() == 1);
-			auto root = std::move(args_.front());
-			args_.clear();
-			return root;
-		}
-
-		std::forward_list<Position> MoveCells() {
-			return std::move(cells_);
+			return builder_.Finish(args_.front());
 		}
 
 		void visitTerminal(antlr4::tree::TerminalNode* node) override {
 			switch (node->getSymbol()->getType()) {
 			case FormulaLexer::CELL: {
+				if (dynamic_cast<FormulaParser::RangeContext*>(node->parent)) {
+					// угол диапазона — диапазон соберёт exitRange
+					break;
+				}
 				auto pos_str = node->getSymbol()->getText();
 				auto pos_value = Position::FromString(pos_str);
 				if (!pos_value.IsValid()) {
 					throw FormulaException("Invalid cell position: " + std::string(pos_str));
 				}
-				cells_.push_front(pos_value);
-				auto expr = std::make_unique<CellExpr>(&cells_.front());
-				args_.push_back(std::move(expr));
+				args_.push_back(builder_.AddCell(pos_value));
 				break;
 			}
 			case FormulaLexer::NUMBER: {
@@ -367,7 +1289,7 @@ namespace ASTImpl {
 				if (!in || !std::isfinite(value)) {
 					throw ParsingError("Invalid number: " + valueStr);
 				}
-				args_.push_back(std::make_unique<NumberExpr>(value));
+				args_.push_back(builder_.AddNumber(value));
 				break;
 			}
 			default:
@@ -376,22 +1298,43 @@ namespace ASTImpl {
 		}
 
 		void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
-			auto operand = std::move(args_.back());
-			UnaryOpExpr::Type type = ctx->SUB() ? UnaryOpExpr::UnaryMinus : UnaryOpExpr::UnaryPlus;
-			args_.back() = std::make_unique<UnaryOpExpr>(type, std::move(operand));
+			args_.back() = builder_.AddUnaryOp(ctx->SUB() ? '-' : '+', args_.back());
 		}
 
 		void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
-			auto rhs = std::move(args_.back()); args_.pop_back();
-			auto lhs = std::move(args_.back());
+			auto rhs = args_.back(); args_.pop_back();
+			auto lhs = args_.back();
+
+			char op;
+			if (ctx->ADD()) op = '+';
+			else if (ctx->SUB()) op = '-';
+			else if (ctx->MUL()) op = '*';
+			else op = '/';
+
+			args_.back() = builder_.AddBinaryOp(op, lhs, rhs);
+		}
 
-			BinaryOpExpr::Type type;
-			if (ctx->ADD()) type = BinaryOpExpr::Add;
-			else if (ctx->SUB()) type = BinaryOpExpr::Subtract;
-			else if (ctx->MUL()) type = BinaryOpExpr::Multiply;
-			else type = BinaryOpExpr::Divide;
+		void exitRange(FormulaParser::RangeContext* ctx) override {
+			Position corners[2];
+			for (size_t i = 0; i < 2; ++i) {
+				auto pos_str = ctx->CELL(i)->getText();
+				corners[i] = Position::FromString(pos_str);
+				if (!corners[i].IsValid()) {
+					throw FormulaException("Invalid cell position: " + pos_str);
+				}
+			}
+			args_.push_back(builder_.AddRange(CellRange::FromCorners(corners[0], corners[1])));
+		}
 
-			args_.back() = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
+		void exitCall(FormulaParser::CallContext* ctx) override {
+			const size_t arg_count = ctx->arg().size();
+			const size_t first = args_.size() - arg_count;
+			for (size_t i = first + 1; i < args_.size(); ++i) {
+				builder_.LinkArgument(args_[i - 1], args_[i]);
+			}
+			const std::uint32_t call = builder_.AddCall(GetFunction(ctx->FUNCTION()->getText()), args_[first]);
+			args_.resize(first);
+			args_.push_back(call);
 		}
 
 		void exitParens(FormulaParser::ParensContext* /*ctx*/) override {
@@ -403,8 +1346,9 @@ namespace ASTImpl {
 		}
 
 	private:
-		std::vector<std::unique_ptr<Expr>> args_;
-		std::forward_list<Position> cells_;
+		// Номера узлов выражений, ещё не вошедших в родительские
+		std::vector<std::uint32_t> args_;
+		TreeBuilder builder_;
 	};
 	class BailErrorListener : public antlr4::BaseErrorListener {
 	public:
@@ -439,7 +1383,7 @@ FormulaAST ParseFormulaAST(std::istream& in) {
 		tree::ParseTree* tree = parser.main();
 		ASTImpl::ParseASTListener listener;
 		tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
-		return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+		return FormulaAST(listener.GetNodes());
 	}
 	catch (const ParseCancellationException&) {
 		throw ParsingError("Syntax error in formula");
@@ -447,31 +1391,331 @@ FormulaAST ParseFormulaAST(std::istream& in) {
 }
 
 FormulaAST ParseFormulaAST(const std::string& in_str) {
-	std::istringstream in(in_str);
-	return ParseFormulaAST(in);
+	return ASTImpl::PrattParser(in_str).Parse();
 }
 
-void FormulaAST::PrintCells(std::ostream& out) const {
-	for (auto cell : cells_) {
-		out << cell.ToString() << ' ';
+std::optional<std::string> GetTemplateKey(const std::string& text, Position anchor) {
+	try {
+		return ASTImpl::PrattParser(text).MakeTemplateKey(anchor);
+	}
+	catch (const ParsingError&) {
+		return std::nullopt;
 	}
 }
 
+void FormulaAST::PrintCells(std::ostream& out) const {
+	ASTImpl::Tree(View<ASTImpl::Node>(nodes_)).PrintCells(out);
+}
+
 void FormulaAST::Print(std::ostream& out) const {
-	root_expr_->Print(out);
+	const ASTImpl::Tree tree(View<ASTImpl::Node>(nodes_));
+	tree.Print(out, tree.GetRoot());
+}
+
+void FormulaAST::PrintFormula(std::ostream& out, Position shift) const {
+	std::string text;
+	PrintFormula(text, shift);
+	out << text;
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-	root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+void FormulaAST::PrintFormula(std::string& out, Position shift) const {
+	const ASTImpl::Tree tree(View<ASTImpl::Node>(nodes_));
+	tree.PrintFormula(out, tree.GetRoot(), ASTImpl::EP_ATOM, shift);
 }
 
-double FormulaAST::Execute(const SheetInterface& sheet) const {
-	return root_expr_->Evaluate(sheet);
+ExecResult FormulaAST::Execute(const SheetInterface& sheet, Position shift) const {
+	ASTImpl::ExecuteFrame frame;
+	for (Position pos : GetArguments()) {
+		frame.AddArgument(ASTImpl::ReadCell(sheet, ShiftPosition(pos, shift)));
+	}
+	for (CellRange range : GetRanges()) {
+		frame.AddRange(sheet, ShiftRange(range, shift));
+	}
+	return Execute(frame.GetArguments(), frame.GetRanges());
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-	: root_expr_(std::move(root_expr))
-	, cells_(std::move(cells)) {
+ExecResult FormulaAST::Execute(const ExecResult* args, const RangeValues* ranges) const {
+	using ASTImpl::OpCode;
+
+	// Небольшие выражения считаются на стеке потока, без аллокаций
+	constexpr std::size_t INLINE_STACK_SIZE = 32;
+	double inline_stack[INLINE_STACK_SIZE];
+	std::unique_ptr<double[]> heap_stack;
+	double* stack = inline_stack;
+	if (stack_size_ > INLINE_STACK_SIZE) {
+		heap_stack = std::make_unique<double[]>(stack_size_);
+		stack = heap_stack.get();
+	}
+
+	// top указывает на первую свободную позицию стека.
+	// Все значения на стеке конечны: операнды проверяются при загрузке,
+	// результаты операций — сразу после вычисления. Первая же ошибка
+	// прерывает вычисление, как и при обходе дерева слева направо.
+	const auto constants = View<double>(constants_);
+	const auto calls = View<ASTImpl::Call>(calls_);
+	const auto call_ranges = View<std::uint32_t>(call_ranges_);
+	double* top = stack;
+	for (const ASTImpl::Instruction& instruction : View<ASTImpl::Instruction>(code_)) {
+		switch (instruction.code) {
+		case OpCode::PushNumber:
+			*top++ = constants[instruction.operand];
+			break;
+		case OpCode::LoadCell: {
+			const ExecResult& value = args[instruction.operand];
+			if (std::holds_alternative<FormulaError>(value)) {
+				return value;
+			}
+			*top++ = std::get<double>(value);
+			break;
+		}
+		case OpCode::Add:
+			--top;
+			top[-1] += top[0];
+			break;
+		case OpCode::Subtract:
+			--top;
+			top[-1] -= top[0];
+			break;
+		case OpCode::Multiply:
+			--top;
+			top[-1] *= top[0];
+			break;
+		case OpCode::Divide:
+			--top;
+			if (top[0] == 0) {
+				return ASTImpl::ARITHMETIC_ERROR;
+			}
+			top[-1] /= top[0];
+			break;
+		case OpCode::Negate:
+			top[-1] = -top[-1];
+			break;
+		case OpCode::CheckRange:
+			if (ranges[instruction.operand].error) {
+				return *ranges[instruction.operand].error;
+			}
+			// Стек не меняется и может быть пуст
+			continue;
+		case OpCode::Call: {
+			const ASTImpl::Call& call = calls[instruction.operand];
+			top -= call.scalar_count;
+			ASTImpl::Accumulator accumulator(call.function);
+			accumulator.Add(top, call.scalar_count);
+			for (std::uint32_t i = 0; i < call.range_count; ++i) {
+				const RangeValues& range = ranges[call_ranges[call.ranges_begin + i]];
+				assert(!range.error);
+				accumulator.Add(range.values, range.count);
+			}
+			const ExecResult result = accumulator.GetResult();
+			if (std::holds_alternative<FormulaError>(result)) {
+				return result;
+			}
+			*top++ = std::get<double>(result);
+			break;
+		}
+		}
+		if (!std::isfinite(top[-1])) {
+			return ASTImpl::ARITHMETIC_ERROR;
+		}
+	}
+
+	assert(top == stack + 1);
+	return stack[0];
+}
+
+namespace ASTImpl {
+
+	// Число экземпляров, которые ExecuteColumn вычисляет за один проход по
+	// программе: столбцы стека остаются в кэше L1, а постоянная длина
+	// циклов позволяет компилятору векторизовать их без хвостов
+	constexpr std::size_t COLUMN_BLOCK = 256;
+
+	// Столбец стека столбцового вычисления
+	using Column = std::array<double, COLUMN_BLOCK>;
+
+	// Применяет операцию к столбцам поэлементно, результат — в lhs.
+	// __restrict: столбцы не пересекаются, иначе компилятор не векторизует цикл
+	template <typename Operation>
+	void CombineColumns(double* __restrict lhs, const double* __restrict rhs, Operation operation) {
+		for (std::size_t k = 0; k < COLUMN_BLOCK; ++k) {
+			lhs[k] = operation(lhs[k], rhs[k]);
+		}
+	}
+
+	// Накапливает в guard признак бесконечного или неопределённого значения:
+	// v * 0 для них — NaN, для конечных — ноль, а NaN сохраняется при сложении.
+	// Деление на ноль тоже даёт бесконечность или NaN, так что отдельной
+	// проверки не требует
+	void GuardColumn(double* __restrict guard, const double* __restrict values) {
+		for (std::size_t k = 0; k < COLUMN_BLOCK; ++k) {
+			guard[k] += values[k] * 0.0;
+		}
+	}
+}
+
+bool FormulaAST::IsColumnExecutable() const {
+	return calls_.size == 0;
+}
+
+void FormulaAST::ExecuteColumn(const double* args, std::size_t count, ExecResult* results) const {
+	using ASTImpl::COLUMN_BLOCK;
+	using ASTImpl::Column;
+	using ASTImpl::OpCode;
+	assert(IsColumnExecutable());
+
+	// Стек — столбцы по COLUMN_BLOCK значений. Ошибки не прерывают
+	// вычисление, а копятся в столбце guard: у экземпляров без ошибок в
+	// аргументах бывает только арифметическая ошибка, и неважно, какая
+	// команда её дала
+	thread_local std::vector<Column> stack;
+	stack.resize(stack_size_ + 1);
+	Column& guard = stack.back();
+
+	for (std::size_t base = 0; base < count; base += COLUMN_BLOCK) {
+		const std::size_t size = std::min(COLUMN_BLOCK, count - base);
+		guard.fill(0.0);
+		// top — первый свободный столбец
+		Column* top = stack.data();
+		for (const ASTImpl::Instruction& instruction : View<ASTImpl::Instruction>(code_)) {
+			switch (instruction.code) {
+			case OpCode::PushNumber:
+				top->fill(View<double>(constants_)[instruction.operand]);
+				++top;
+				break;
+			case OpCode::LoadCell: {
+				const double* column = args + instruction.operand * count + base;
+				std::copy(column, column + size, top->begin());
+				// Хвост последнего блока: значения не используются
+				std::fill(top->begin() + size, top->end(), 1.0);
+				++top;
+				break;
+			}
+			case OpCode::Add:
+				--top;
+				ASTImpl::CombineColumns(top[-1].data(), top[0].data(), std::plus<>());
+				break;
+			case OpCode::Subtract:
+				--top;
+				ASTImpl::CombineColumns(top[-1].data(), top[0].data(), std::minus<>());
+				break;
+			case OpCode::Multiply:
+				--top;
+				ASTImpl::CombineColumns(top[-1].data(), top[0].data(), std::multiplies<>());
+				break;
+			case OpCode::Divide:
+				--top;
+				ASTImpl::CombineColumns(top[-1].data(), top[0].data(), std::divides<>());
+				break;
+			case OpCode::Negate:
+				for (double& value : top[-1]) {
+					value = -value;
+				}
+				break;
+			case OpCode::CheckRange:
+			case OpCode::Call:
+				assert(false && "Function calls are not executed by columns");
+				break;
+			}
+			// Как и в Execute: бесконечность после любой команды — ошибка,
+			// даже если дальше она дала бы конечное число (1/(A1*1e308))
+			ASTImpl::GuardColumn(guard.data(), top[-1].data());
+		}
+
+		assert(top == stack.data() + 1);
+		const Column& result = stack[0];
+		for (std::size_t k = 0; k < size; ++k) {
+			results[base + k] = guard[k] == 0 ? ExecResult(result[k]) : ExecResult(ASTImpl::ARITHMETIC_ERROR);
+		}
+	}
+}
+
+ExecResult FormulaAST::ExecuteTree(const SheetInterface& sheet) const {
+	const ASTImpl::Tree tree(View<ASTImpl::Node>(nodes_));
+	return tree.Evaluate(sheet, tree.GetRoot());
+}
+
+FormulaAST::FormulaAST(ASTImpl::ArrayView<ASTImpl::Node> nodes) {
+	using ASTImpl::OpCode;
+
+	ASTImpl::Program& program = ASTImpl::Program::GetBuffer();
+	const ASTImpl::Tree tree(nodes);
+	tree.Compile(program, tree.GetRoot());
+
+	// Упорядочиваем аргументы и переводим номера вхождений в номера аргументов
+	program.unique_arguments = program.arguments;
+	std::sort(program.unique_arguments.begin(), program.unique_arguments.end());
+	program.unique_arguments.erase(std::unique(program.unique_arguments.begin(), program.unique_arguments.end()),
+		program.unique_arguments.end());
+	for (ASTImpl::Instruction& instruction : program.code) {
+		if (instruction.code == OpCode::LoadCell) {
+			const Position pos = program.arguments[instruction.operand];
+			assert(pos.IsValid());
+			instruction.operand = static_cast<std::uint32_t>(
+				std::lower_bound(program.unique_arguments.begin(), program.unique_arguments.end(), pos)
+				- program.unique_arguments.begin());
+		}
+	}
+
+	// Диапазоны упорядочиваем так же
+	program.unique_ranges = program.ranges;
+	std::sort(program.unique_ranges.begin(), program.unique_ranges.end());
+	program.unique_ranges.erase(std::unique(program.unique_ranges.begin(), program.unique_ranges.end()),
+		program.unique_ranges.end());
+	auto range_index = [&](std::uint32_t occurrence) {
+		return static_cast<std::uint32_t>(
+			std::lower_bound(program.unique_ranges.begin(), program.unique_ranges.end(), program.ranges[occurrence])
+			- program.unique_ranges.begin());
+	};
+	for (std::uint32_t& index : program.call_ranges) {
+		index = range_index(index);
+	}
+	for (ASTImpl::Instruction& instruction : program.code) {
+		if (instruction.code == OpCode::CheckRange) {
+			instruction.operand = range_index(instruction.operand);
+		}
+	}
+
+	// Глубина стека: числа и ячейки кладут значение, бинарные операции снимают
+	// одно, вызов функции снимает свои аргументы-выражения и кладёт результат
+	std::size_t depth = 0;
+	for (const ASTImpl::Instruction& instruction : program.code) {
+		switch (instruction.code) {
+		case OpCode::PushNumber:
+		case OpCode::LoadCell:
+			++depth;
+			break;
+		case OpCode::Negate:
+		case OpCode::CheckRange:
+			break;
+		case OpCode::Call:
+			depth = depth - program.calls[instruction.operand].scalar_count + 1;
+			break;
+		default:
+			--depth;
+		}
+		stack_size_ = std::max(stack_size_, depth);
+	}
+
+	// Массивы с большим выравниванием — первыми
+	std::size_t size = 0;
+	nodes_ = ASTImpl::ReserveArray<ASTImpl::Node>(size, nodes.size());
+	constants_ = ASTImpl::ReserveArray<double>(size, program.constants.size());
+	code_ = ASTImpl::ReserveArray<ASTImpl::Instruction>(size, program.code.size());
+	arguments_ = ASTImpl::ReserveArray<Position>(size, program.unique_arguments.size());
+	ranges_ = ASTImpl::ReserveArray<CellRange>(size, program.unique_ranges.size());
+	calls_ = ASTImpl::ReserveArray<ASTImpl::Call>(size, program.calls.size());
+	call_ranges_ = ASTImpl::ReserveArray<std::uint32_t>(size, program.call_ranges.size());
+
+	block_.reset(new std::byte[size]);
+	ASTImpl::StoreArray(block_.get(), nodes_, nodes.begin());
+	ASTImpl::StoreArray(block_.get(), constants_, program.constants.data());
+	ASTImpl::StoreArray(block_.get(), code_, program.code.data());
+	ASTImpl::StoreArray(block_.get(), arguments_, program.unique_arguments.data());
+	ASTImpl::StoreArray(block_.get(), ranges_, program.unique_ranges.data());
+	ASTImpl::StoreArray(block_.get(), calls_, program.calls.data());
+	ASTImpl::StoreArray(block_.get(), call_ranges_, program.call_ranges.data());
 }
 
+FormulaAST::FormulaAST(FormulaAST&&) noexcept = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) noexcept = default;
 FormulaAST::~FormulaAST() = default;
\ No newline at end of file
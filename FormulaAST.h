@@ -3,46 +3,185 @@
 #include "FormulaLexer.h"
 #include "common.h"
 
-#include <forward_list>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
 #include <stdexcept>
+#include <string>
 
 namespace ASTImpl {
-    class Expr;
+    struct Node;
+
+    // Команды стековой машины
+    enum class OpCode : std::uint8_t {
+        PushNumber,  // положить на стек constants[operand]
+        LoadCell,    // положить на стек аргумент args[operand]
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        Negate,
+        CheckRange,  // прервать вычисление ошибкой диапазона ranges[operand]
+        Call,        // вызвать функцию calls[operand]
+    };
+
+    // Встроенные функции формул
+    enum class Function : std::uint8_t {
+        Sum,
+        Average,
+        Min,
+        Max,
+        Count,
+    };
+
+    // Вызов функции: снимает со стека значения scalar_count аргументов-выражений
+    // и кладёт результат. Аргументы-диапазоны — range_count номеров диапазонов,
+    // начиная с call_ranges[ranges_begin]; их ошибки проверяет CheckRange на
+    // месте аргумента, до следующих аргументов
+    struct Call {
+        Function function;
+        std::uint32_t scalar_count = 0;
+        std::uint32_t ranges_begin = 0;
+        std::uint32_t range_count = 0;
+    };
+
+    struct Instruction {
+        OpCode code;
+        std::uint32_t operand = 0;
+    };
+
+    // Массив в блоке формулы: смещение от начала блока в байтах и число элементов
+    struct BlockArray {
+        std::uint32_t offset = 0;
+        std::uint32_t size = 0;
+    };
+
+    // Массив из блока формулы, только для чтения
+    template <typename T>
+    class ArrayView {
+    public:
+        ArrayView(const T* data, std::size_t size)
+            : data_(data)
+            , size_(size) {
+        }
+
+        const T* begin() const {
+            return data_;
+        }
+
+        const T* end() const {
+            return data_ + size_;
+        }
+
+        std::size_t size() const {
+            return size_;
+        }
+
+        bool empty() const {
+            return size_ == 0;
+        }
+
+        const T& operator[](std::size_t index) const {
+            return data_[index];
+        }
+
+    private:
+        const T* data_;
+        std::size_t size_;
+    };
+}
+
+// Сдвигает позицию на shift: строки и столбцы складываются
+inline Position ShiftPosition(Position pos, Position shift) {
+    return Position{pos.row + shift.row, pos.col + shift.col};
+}
+
+inline CellRange ShiftRange(CellRange range, Position shift) {
+    return CellRange{ShiftPosition(range.first, shift), ShiftPosition(range.last, shift)};
 }
 
+// Результат вычисления формулы: число либо ошибка.
+// Ошибки распространяются как значения, без исключений.
+using ExecResult = std::variant<double, FormulaError>;
+
 class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
 
 class FormulaAST {
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+    // Узлы дерева в порядке «дети, затем родитель»: корень — последний.
+    // Узлы копируются в блок формулы
+    explicit FormulaAST(ASTImpl::ArrayView<ASTImpl::Node> nodes);
+    FormulaAST(FormulaAST&&) noexcept;
+    FormulaAST& operator=(FormulaAST&&) noexcept;
     ~FormulaAST();
 
-    double Execute(const SheetInterface& sheet) const;
+    // Вычисляет формулу байткодом, читая аргументы из листа.
+    // shift сдвигает все ссылки формулы (см. GetTemplateKey)
+    ExecResult Execute(const SheetInterface& sheet, Position shift = {}) const;
+    // Вычисляет формулу байткодом по готовым значениям аргументов:
+    // args[i] соответствует GetArguments()[i], ranges[i] — GetRanges()[i]
+    ExecResult Execute(const ExecResult* args, const RangeValues* ranges) const;
+    // Вычисляет count экземпляров формулы с разными аргументами сразу,
+    // по командам, каждая — над столбцом значений всех экземпляров.
+    // args[i * count + k] — i-й аргумент k-го экземпляра, все аргументы
+    // конечны; results[k] — результат k-го экземпляра. Только для формул
+    // без вызовов функций (см. IsColumnExecutable)
+    void ExecuteColumn(const double* args, std::size_t count, ExecResult* results) const;
+    bool IsColumnExecutable() const;
+    // Вычисляет формулу обходом дерева (эталон для сравнения с байткодом)
+    ExecResult ExecuteTree(const SheetInterface& sheet) const;
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
+    void PrintFormula(std::ostream& out, Position shift = {}) const;
+    // Дописывает текст формулы к out (как PrintFormula в поток)
+    void PrintFormula(std::string& out, Position shift = {}) const;
 
-    std::forward_list<Position>& GetCells() {
-        return cells_;
+    // Ячейки, на которые ссылается формула: по возрастанию, без повторов
+    ASTImpl::ArrayView<Position> GetArguments() const {
+        return View<Position>(arguments_);
     }
 
-    const std::forward_list<Position>& GetCells() const {
-        return cells_;
+    // Диапазоны из аргументов функций: по возрастанию, без повторов
+    ASTImpl::ArrayView<CellRange> GetRanges() const {
+        return View<CellRange>(ranges_);
     }
 
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
+    template <typename T>
+    ASTImpl::ArrayView<T> View(ASTImpl::BlockArray array) const {
+        return { reinterpret_cast<const T*>(block_.get() + array.offset), array.size };
+    }
 
-    // physically stores cells so that they can be
-    // efficiently traversed without going through
-    // the whole AST
-    std::forward_list<Position> cells_;
+private:
+    // Дерево и байткод формулы лежат в одном блоке точного размера: одна
+    // аллокация на формулу. Узлы ссылаются друг на друга по номерам, позиции
+    // ячеек хранятся в самих узлах.
+    // Байткод — в обратной польской записи, порядок вычисления операндов
+    // совпадает с обходом дерева (слева направо). Аргументы — упорядоченные
+    // без повторов ячейки формулы, LoadCell адресует их по номеру;
+    // диапазоны упорядочены так же
+    std::unique_ptr<std::byte[]> block_;
+    ASTImpl::BlockArray nodes_;
+    ASTImpl::BlockArray constants_;
+    ASTImpl::BlockArray code_;
+    ASTImpl::BlockArray arguments_;
+    ASTImpl::BlockArray ranges_;
+    ASTImpl::BlockArray calls_;
+    ASTImpl::BlockArray call_ranges_;
+    std::size_t stack_size_ = 0;
 };
 
+// Разбор через ANTLR — эталонная реализация
 FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
\ No newline at end of file
+// Быстрый разбор без ANTLR (парсер Пратта); дерево и ошибки те же
+FormulaAST ParseFormulaAST(const std::string& in_str);
+
+// Ключ общего шаблона формулы: её лексемы, в которых ссылки на ячейки
+// заменены смещениями от anchor (ячейки формулы). Формулы с равными ключами
+// разбираются в одно и то же дерево с точностью до сдвига всех ссылок на
+// разницу их anchor. Строится одним проходом лексера, без разбора.
+// nullopt — в тексте ошибка лексера или некорректная ячейка
+std::optional<std::string> GetTemplateKey(const std::string& text, Position anchor);
\ No newline at end of file
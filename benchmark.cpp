@@ -0,0 +1,1178 @@
+#include "benchmark.h"
+
+#include "FormulaAST.h"
+#include "cell.h"
+#include "common.h"
+#include "formula.h"
+#include "profile.h"
+#include "sheet.h"
+#include "storage.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <iterator>
+#include <optional>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#ifdef __linux__
+#include <fstream>
+#include <unistd.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+using namespace std::literals;
+
+namespace {
+
+	struct Benchmark {
+		std::string_view name;
+		void (*run)();
+	};
+
+	// Резидентная память процесса в байтах; nullopt, если платформа
+	// не позволяет её узнать. Освобождённая куча сначала возвращается
+	// системе, иначе замеры подряд занижают друг друга
+	std::optional<size_t> ResidentBytes() {
+#ifdef __GLIBC__
+		malloc_trim(0);
+#endif
+#ifdef __linux__
+		std::ifstream statm("/proc/self/statm");
+		size_t total_pages = 0;
+		size_t resident_pages = 0;
+		if (statm >> total_pages >> resident_pages) {
+			return resident_pages * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+		}
+#endif
+		return std::nullopt;
+	}
+
+	std::string_view StorageName(StorageType type) {
+		switch (type) {
+		case StorageType::Hash:
+			return "hash"sv;
+		case StorageType::Tiled:
+			return "tiled"sv;
+		case StorageType::FlatHash:
+			return "flat hash"sv;
+		}
+		return ""sv;
+	}
+
+	// Генерирует count случайных корректных позиций в прямоугольнике rows x cols
+	std::vector<Position> RandomPositions(int count, int rows, int cols) {
+		std::mt19937 generator(42);
+		std::uniform_int_distribution<int> row_dist(0, rows - 1);
+		std::uniform_int_distribution<int> col_dist(0, cols - 1);
+		std::vector<Position> positions(count);
+		for (auto& pos : positions) {
+			pos = Position{ row_dist(generator), col_dist(generator) };
+		}
+		return positions;
+	}
+
+	/*
+	 * Хранилище ячеек: заполнение, поиск и построчный обход
+	 * на плотном (512x512) и разреженном (200k случайных позиций в 2048x2048) наборах.
+	 */
+	void BenchStorage() {
+		std::vector<Position> dense;
+		for (int r = 0; r < 512; ++r) {
+			for (int c = 0; c < 512; ++c) {
+				dense.push_back(Position{ r, c });
+			}
+		}
+		auto sparse = RandomPositions(200'000, 2048, 2048);
+
+		for (StorageType type : { StorageType::Hash, StorageType::Tiled, StorageType::FlatHash }) {
+			for (const auto& [set_name, positions, rows] :
+				{ std::tuple{ "dense"sv, &dense, 512 }, std::tuple{ "sparse"sv, &sparse, 2048 } }) {
+				auto storage = CreateCellStorage(type);
+				const std::string prefix = std::string(StorageName(type)) + " " + std::string(set_name);
+				{
+					LOG_DURATION(prefix + " emplace");
+					for (Position pos : *positions) {
+						storage->Emplace(pos);
+					}
+				}
+				size_t found = 0;
+				{
+					LOG_DURATION(prefix + " find");
+					for (int i = 0; i < 4; ++i) {
+						for (Position pos : *positions) {
+							found += storage->Find(pos) != nullptr;
+						}
+					}
+				}
+				{
+					LOG_DURATION(prefix + " row scan " + std::to_string(rows) + "x512");
+					for (int r = 0; r < rows; ++r) {
+						for (int c = 0; c < 512; ++c) {
+							found += storage->Find(Position{ r, c }) != nullptr;
+						}
+					}
+				}
+				std::cerr << "  (" << found << " hits)" << std::endl;
+			}
+		}
+	}
+
+	/*
+	 * Разреженные хранилища на хэш-таблицах: std::unordered_map с узлами
+	 * против открытой адресации. Вставка, поиск существующих и отсутствующих
+	 * ячеек при 10k, 1M и 10M случайных позиций по всему листу.
+	 */
+	void BenchSparseHash() {
+		for (int count : { 10'000, 1'000'000, 10'000'000 }) {
+			const auto positions = RandomPositions(count, Position::MAX_ROWS, Position::MAX_COLS);
+			std::vector<Position> shuffled = positions;
+			std::shuffle(shuffled.begin(), shuffled.end(), std::mt19937(7));
+			std::vector<Position> misses(shuffled.size());
+			std::transform(shuffled.begin(), shuffled.end(), misses.begin(), [](Position pos) {
+				// Отражение позиции: почти всегда её нет среди случайных
+				return Position{ Position::MAX_ROWS - 1 - pos.row, pos.col };
+				});
+			// Малые наборы повторяем, чтобы замер был заметен
+			const int rounds = std::max(1, 1'000'000 / count);
+
+			for (StorageType type : { StorageType::Hash, StorageType::FlatHash }) {
+				const std::string prefix = std::string(StorageName(type)) + " " + std::to_string(count) + " cells";
+				size_t found = 0;
+				{
+					std::vector<std::unique_ptr<CellStorage>> storages(rounds);
+					LOG_DURATION(prefix + " insert x" + std::to_string(rounds));
+					for (auto& storage : storages) {
+						storage = CreateCellStorage(type);
+						for (Position pos : positions) {
+							storage->Emplace(pos);
+						}
+					}
+				}
+				auto storage = CreateCellStorage(type);
+				for (Position pos : positions) {
+					storage->Emplace(pos);
+				}
+				{
+					LOG_DURATION(prefix + " lookup hit x" + std::to_string(rounds));
+					for (int round = 0; round < rounds; ++round) {
+						for (Position pos : shuffled) {
+							found += storage->Find(pos) != nullptr;
+						}
+					}
+				}
+				{
+					LOG_DURATION(prefix + " lookup miss x" + std::to_string(rounds));
+					for (int round = 0; round < rounds; ++round) {
+						for (Position pos : misses) {
+							found += storage->Find(pos) != nullptr;
+						}
+					}
+				}
+				std::cerr << "  (" << found << " hits)" << std::endl;
+			}
+		}
+	}
+
+	/*
+	 * Преобразование адресов ячеек: 10M позиций в текст и обратно,
+	 * через std::string и через буфер вызывающего.
+	 */
+	void BenchPositionText() {
+		const auto positions = RandomPositions(10'000'000, Position::MAX_ROWS, Position::MAX_COLS);
+		std::vector<std::string> texts;
+		texts.reserve(positions.size());
+		size_t total = 0;
+		{
+			LOG_DURATION("10M Position::ToString");
+			for (Position pos : positions) {
+				texts.push_back(pos.ToString());
+			}
+		}
+		{
+			LOG_DURATION("10M Position::ToChars");
+			char buffer[Position::MAX_STRING_SIZE];
+			for (Position pos : positions) {
+				total += pos.ToChars(buffer) + static_cast<unsigned char>(buffer[0]);
+			}
+		}
+		{
+			LOG_DURATION("10M Position::FromString");
+			for (const std::string& text : texts) {
+				total += Position::FromString(text).Pack();
+			}
+		}
+		{
+			LOG_DURATION("10M Position::FromChars");
+			for (const std::string& text : texts) {
+				total += Position::FromChars(text).Pack();
+			}
+		}
+		std::cerr << "  (checksum " << total << ")" << std::endl;
+	}
+
+	/*
+	 * Массовая загрузка: 500k текстовых ячеек через SetCell, затем очистка
+	 * в обратном порядке. Печатная область поддерживается инкрементально,
+	 * поэтому обе фазы линейны по числу ячеек.
+	 */
+	void BenchBulkLoad() {
+		constexpr int ROWS = 5000;
+		constexpr int COLS = 100;
+		for (StorageType type : { StorageType::Hash, StorageType::Tiled, StorageType::FlatHash }) {
+			Sheet sheet(type);
+			const std::string prefix = std::string(StorageName(type)) + " 500k cells";
+			{
+				LOG_DURATION(prefix + " SetCell");
+				for (int r = 0; r < ROWS; ++r) {
+					for (int c = 0; c < COLS; ++c) {
+						sheet.SetCell(Position{ r, c }, "text");
+					}
+				}
+			}
+			{
+				LOG_DURATION(prefix + " ClearCell");
+				for (int r = ROWS - 1; r >= 0; --r) {
+					for (int c = COLS - 1; c >= 0; --c) {
+						sheet.ClearCell(Position{ r, c });
+					}
+				}
+			}
+		}
+	}
+
+	/*
+	 * Импорт формул: 100k формул по 4 ссылки поверх 100k числовых ячеек.
+	 * Перепривязка зависимостей использует позицию, хранимую в ячейке.
+	 */
+	void BenchFormulaImport() {
+		constexpr int ROWS = 10000;
+		constexpr int COLS = 10;
+		Sheet sheet;
+		for (int r = 0; r < ROWS; ++r) {
+			for (int c = 0; c < COLS; ++c) {
+				sheet.SetCell(Position{ r, c }, std::to_string(r + c));
+			}
+		}
+		LOG_DURATION("100k formulas x 4 refs SetCell");
+		for (int r = 0; r < ROWS; ++r) {
+			for (int c = 0; c < COLS; ++c) {
+				const std::string row = std::to_string(r + 1);
+				const std::string col(1, static_cast<char>('A' + c));
+				sheet.SetCell(Position{ r, COLS + c },
+					"=A" + row + "+B" + row + "*" + col + row + "-J" + row);
+			}
+		}
+	}
+
+	// Позиция i-й ячейки цепочки: столбцы заполняются сверху вниз по очереди
+	Position ChainPosition(int index) {
+		return Position{ index % Position::MAX_ROWS, index / Position::MAX_ROWS };
+	}
+
+	/*
+	 * Инвалидация кэша:
+	 * - решётка из 25 слоёв, где каждая ячейка питает две ячейки ниже
+	 *   (число путей от вершины растёт экспоненциально);
+	 * - цепочка из 1M формул, кэш которых заполнен: изменение листа
+	 *   сбрасывает всё зависимое замыкание.
+	 */
+	void BenchInvalidation() {
+		{
+			constexpr int LAYERS = 25;
+			Sheet sheet;
+			for (int c = 0; c < LAYERS; ++c) {
+				sheet.SetCell(Position{ 0, c }, "1");
+			}
+			for (int r = 1; r < LAYERS; ++r) {
+				for (int c = 0; c + r < LAYERS; ++c) {
+					sheet.SetCell(Position{ r, c }, "=" + Position{ r - 1, c }.ToString()
+						+ "+" + Position{ r - 1, c + 1 }.ToString());
+				}
+			}
+			sheet.GetCell(Position{ LAYERS - 1, 0 })->GetValue();
+			LOG_DURATION("lattice 25 layers: invalidate from the top");
+			sheet.SetCell(Position{ 0, LAYERS / 2 }, "2");
+		}
+		{
+			constexpr int LENGTH = 1'000'000;
+			Sheet sheet;
+			for (int i = 0; i < LENGTH - 1; ++i) {
+				sheet.SetCell(ChainPosition(i), "=" + ChainPosition(i + 1).ToString() + "+1");
+			}
+			sheet.SetCell(ChainPosition(LENGTH - 1), "0");
+			sheet.GetCell(ChainPosition(0))->GetValue();
+			LOG_DURATION("chain 1M: invalidate dependent closure");
+			sheet.SetCell(ChainPosition(LENGTH - 1), "1");
+		}
+	}
+
+	// Случайное выражение: числа и ссылки на ячейки A1:J100, четыре операции,
+	// унарный минус и скобки; depth — глубина вложенности
+	std::string RandomExpression(std::mt19937& generator, int depth) {
+		std::uniform_int_distribution<int> choice(0, 9);
+		const int kind = depth > 0 ? choice(generator) : choice(generator) % 2;
+		if (kind == 0) {
+			return std::to_string(choice(generator) + 1);
+		}
+		if (kind == 1) {
+			return Position{ choice(generator) * 10 + choice(generator), choice(generator) }.ToString();
+		}
+		if (kind == 2) {
+			return "-(" + RandomExpression(generator, depth - 1) + ")";
+		}
+		static constexpr char OPERATIONS[] = "+-*/";
+		return "(" + RandomExpression(generator, depth - 1) + OPERATIONS[kind % 4]
+			+ RandomExpression(generator, depth - 1) + ")";
+	}
+
+	/*
+	 * Вычисление формул: обход дерева против байткода.
+	 * 10k случайных формул, каждая вычисляется 100 раз — 1M вычислений.
+	 */
+	void BenchFormulaVm() {
+		Sheet sheet;
+		for (int r = 0; r < 100; ++r) {
+			for (int c = 0; c < 10; ++c) {
+				sheet.SetCell(Position{ r, c }, std::to_string(r * 10 + c + 1));
+			}
+		}
+
+		std::mt19937 generator(7);
+		std::vector<FormulaAST> formulas;
+		for (int i = 0; i < 10'000; ++i) {
+			formulas.push_back(ParseFormulaAST(RandomExpression(generator, 4)));
+		}
+
+		auto run = [&](auto execute) {
+			double checksum = 0;
+			size_t errors = 0;
+			for (int i = 0; i < 100; ++i) {
+				for (const FormulaAST& formula : formulas) {
+					ExecResult result = execute(formula);
+					if (std::holds_alternative<double>(result)) {
+						checksum += std::get<double>(result);
+					}
+					else {
+						++errors;
+					}
+				}
+			}
+			std::cerr << "  (checksum " << checksum << ", errors " << errors << ")" << std::endl;
+		};
+		{
+			LOG_DURATION("1M evaluations: tree walk");
+			run([&](const FormulaAST& formula) { return formula.ExecuteTree(sheet); });
+		}
+		{
+			LOG_DURATION("1M evaluations: bytecode VM");
+			run([&](const FormulaAST& formula) { return formula.Execute(sheet); });
+		}
+	}
+
+	/*
+	 * Каскад ошибок: в каждом из 10 столбцов первая ячейка ссылается
+	 * на нечисловой текст, остальные 16383 — на ячейку выше.
+	 * Все 164k формул вычисляются в #VALUE!; лист пересчитывается 5 раз.
+	 */
+	void BenchErrorColumn() {
+		constexpr int COLS = 10;
+		Sheet sheet;
+		sheet.SetCell(Position{ 0, 0 }, "not a number");
+		for (int c = 1; c <= COLS; ++c) {
+			// Снизу вверх: каждая новая формула ссылается на ещё пустую ячейку,
+			// и проверка циклов не проходит по уже построенной цепочке
+			for (int r = Position::MAX_ROWS - 1; r > 0; --r) {
+				sheet.SetCell(Position{ r, c }, "=" + Position{ r - 1, c }.ToString() + "*2");
+			}
+			sheet.SetCell(Position{ 0, c }, "=A1+1");
+		}
+
+		LOG_DURATION("164k error cells x 5 recalculations");
+		size_t errors = 0;
+		for (int pass = 0; pass < 5; ++pass) {
+			sheet.SetCell(Position{ 0, 0 }, pass % 2 ? "text" : "more text");
+			// Сверху вниз: каждая ячейка читает уже вычисленную ячейку выше
+			for (int c = 1; c <= COLS; ++c) {
+				for (int r = 0; r < Position::MAX_ROWS; ++r) {
+					errors += std::holds_alternative<FormulaError>(sheet.GetCell(Position{ r, c })->GetValue());
+				}
+			}
+		}
+		std::cerr << "  (" << errors << " errors)" << std::endl;
+	}
+
+	/*
+	 * Чтение аргументов: 160k формул, ссылающихся на 3 уже вычисленные формулы.
+	 * Сравнивается вычисление через поиск ячеек в листе (Formula::Evaluate)
+	 * и через ячейки, привязанные при установке формулы (пересчёт Cell).
+	 */
+	void BenchBoundReferences() {
+		constexpr int ROWS = 16000;
+		constexpr int COLS = 10;
+		Sheet sheet;
+		std::vector<std::unique_ptr<FormulaInterface>> formulas;
+		for (int r = 0; r < ROWS; ++r) {
+			const std::string row = std::to_string(r + 1);
+			sheet.SetCell(Position{ r, 0 }, std::to_string(r));
+			sheet.SetCell(Position{ r, 1 }, "=A" + row + "*2");
+			sheet.SetCell(Position{ r, 2 }, "=A" + row + "+1");
+			sheet.SetCell(Position{ r, 3 }, "=A" + row + "-1");
+			for (int c = 0; c < COLS; ++c) {
+				std::string expression = "B" + row + "*C" + row + "-D" + row + "/" + std::to_string(c + 1);
+				sheet.SetCell(Position{ r, 4 + c }, "=" + expression);
+				formulas.push_back(ParseFormula(std::move(expression)));
+			}
+		}
+		for (int r = 0; r < ROWS; ++r) {
+			for (int c = 1; c < 4; ++c) {
+				sheet.GetCell(Position{ r, c })->GetValue();
+			}
+		}
+
+		double checksum = 0;
+		{
+			LOG_DURATION("160k formulas x 5: sheet lookups");
+			for (int pass = 0; pass < 5; ++pass) {
+				for (const auto& formula : formulas) {
+					checksum += std::get<double>(formula->Evaluate(sheet));
+				}
+			}
+		}
+		{
+			LOG_DURATION("160k formulas x 5: bound cells");
+			for (int pass = 0; pass < 5; ++pass) {
+				// Сброс кэшей только у формул столбцов E:N
+				sheet.SetCell(Position{ 0, 0 }, pass % 2 ? "0" : "0.0");
+				for (int r = 0; r < ROWS; ++r) {
+					for (int c = 0; c < COLS; ++c) {
+						auto* cell = static_cast<Cell*>(sheet.GetCell(Position{ r, 4 + c }));
+						cell->InvalidateCache(sheet);
+						checksum -= std::get<double>(cell->GetValue());
+					}
+				}
+			}
+		}
+		std::cerr << "  (difference " << checksum << ")" << std::endl;
+	}
+
+	/*
+	 * Глубокая цепочка: A1=A2+1, A2=A3+1, ... длиной 1M.
+	 * Чтение вершины вычисляет всю цепочку; рекурсивное вычисление
+	 * на такой глубине переполняло стек.
+	 */
+	void BenchDeepChain() {
+		constexpr int LENGTH = 1'000'000;
+		Sheet sheet;
+		for (int i = 0; i < LENGTH - 1; ++i) {
+			sheet.SetCell(ChainPosition(i), "=" + ChainPosition(i + 1).ToString() + "+1");
+		}
+		sheet.SetCell(ChainPosition(LENGTH - 1), "0");
+		const CellInterface* top = sheet.GetCell(ChainPosition(0));
+		{
+			LOG_DURATION("chain 1M: first evaluation");
+			std::cerr << "  (top = " << std::get<double>(top->GetValue()) << ")" << std::endl;
+		}
+		sheet.SetCell(ChainPosition(LENGTH - 1), "1");
+		{
+			LOG_DURATION("chain 1M: recalculation after change");
+			std::cerr << "  (top = " << std::get<double>(top->GetValue()) << ")" << std::endl;
+		}
+	}
+
+	/*
+	 * Параллельный пересчёт: 200 столбцов по 4096 формул, все вычисляются
+	 * из общего входного столбца A, плюс итоговый столбец по строкам.
+	 * После изменения всех входов лист пересчитывается на 1/2/4/8/16 потоках.
+	 */
+	void BenchParallelRecalc() {
+		constexpr int ROWS = 4096;
+		constexpr int COLS = 200;
+		Sheet sheet;
+		for (int r = 0; r < ROWS + 2; ++r) {
+			sheet.SetCell(Position{ r, 0 }, std::to_string(r % 97));
+		}
+		for (int r = 0; r < ROWS; ++r) {
+			const std::string a0 = Position{ r, 0 }.ToString();
+			const std::string a1 = Position{ r + 1, 0 }.ToString();
+			const std::string a2 = Position{ r + 2, 0 }.ToString();
+			for (int c = 1; c <= COLS; ++c) {
+				const std::string k = std::to_string(c);
+				sheet.SetCell(Position{ r, c }, "=(" + a0 + "+" + a1 + ")*" + k + "-" + a2 + "/(" + k
+					+ "+" + a0 + ")+(" + a1 + "-" + k + ")*(" + a2 + "+1)/" + k);
+			}
+			sheet.SetCell(Position{ r, COLS + 1 }, "=" + Position{ r, 1 }.ToString() + "+"
+				+ Position{ r, COLS / 2 }.ToString() + "+" + Position{ r, COLS }.ToString());
+		}
+
+		const CellInterface* total = sheet.GetCell(Position{ ROWS - 1, COLS + 1 });
+		for (size_t threads : { 1, 2, 4, 8, 16 }) {
+			sheet.SetRecalculationThreads(threads);
+			for (int r = 0; r < ROWS + 2; ++r) {
+				sheet.SetCell(Position{ r, 0 }, std::to_string((r + threads) % 97));
+			}
+			{
+				LOG_DURATION("823k formulas, " + std::to_string(threads) + " thread(s)");
+				sheet.Recalculate();
+			}
+			std::cerr << "  (last total " << std::get<double>(total->GetValue()) << ")" << std::endl;
+		}
+	}
+
+	/*
+	 * Проверка циклов при вставке формул:
+	 * - цепочка, построенная снизу вверх: каждая новая формула ссылается
+	 *   на вершину уже готовой цепочки (полный обход — O(N) на вставку);
+	 * - случайные формулы с 1-3 ссылками в квадрате 100x100,
+	 *   часть из которых замыкает цикл и отклоняется.
+	 * Отладочная сверка с обходом в глубину включена без NDEBUG.
+	 */
+	void BenchCycleCheck() {
+		{
+			constexpr int LENGTH = 200'000;
+			Sheet sheet;
+			sheet.SetCell(ChainPosition(LENGTH), "0");
+			LOG_DURATION("chain 200k built bottom-up");
+			for (int i = LENGTH - 1; i >= 0; --i) {
+				sheet.SetCell(ChainPosition(i), "=" + ChainPosition(i + 1).ToString() + "+1");
+			}
+		}
+		{
+			constexpr int SIDE = 100;
+			Sheet sheet;
+			std::mt19937 generator(11);
+			std::uniform_int_distribution<int> coord(0, SIDE - 1);
+			std::uniform_int_distribution<int> ref_count(1, 3);
+			size_t cycles = 0;
+			LOG_DURATION("50k random formulas in 100x100");
+			for (int step = 0; step < 50'000; ++step) {
+				std::string text = "=1";
+				for (int i = ref_count(generator); i > 0; --i) {
+					text += "+" + Position{ coord(generator), coord(generator) }.ToString();
+				}
+				try {
+					sheet.SetCell(Position{ coord(generator), coord(generator) }, std::move(text));
+				}
+				catch (const CircularDependencyException&) {
+					++cycles;
+				}
+			}
+			std::cerr << "  (" << cycles << " cycles rejected)" << std::endl;
+		}
+	}
+
+	/*
+	 * Пропускная способность разбора: 100k случайных формул глубины 4
+	 * быстрым парсером и эталонным разбором через ANTLR.
+	 */
+	void BenchParseThroughput() {
+		std::mt19937 generator(5);
+		std::vector<std::string> texts;
+		for (int i = 0; i < 100'000; ++i) {
+			texts.push_back(RandomExpression(generator, 4));
+		}
+
+		auto run = [&](std::string_view name, auto parse) {
+			LogDuration timer(name);
+			size_t cells = 0;
+			for (const std::string& text : texts) {
+				const FormulaAST ast = parse(text);
+				cells += ast.GetArguments().size();
+			}
+			const double seconds = timer.Seconds();
+			std::cerr << "  (" << static_cast<size_t>(texts.size() / seconds) << " formulas/s, "
+				<< cells << " distinct cell references)" << std::endl;
+		};
+		run("100k formulas: Pratt parser", [](const std::string& text) {
+			return ParseFormulaAST(text);
+			});
+		run("100k formulas: ANTLR", [](const std::string& text) {
+			std::istringstream in(text);
+			return ParseFormulaAST(in);
+			});
+	}
+
+	/*
+	 * Пакетная загрузка: 500k ячеек (50 столбцов x 10k строк), первый
+	 * столбец — числа, остальные — формулы от соседних ячеек слева.
+	 * Построчные SetCell против одного SetCells на 1 и 4 потоках.
+	 */
+	void BenchBatchLoad() {
+		constexpr int ROWS = 10'000;
+		constexpr int COLS = 50;
+		auto make_updates = [] {
+			std::vector<Sheet::CellUpdate> updates;
+			updates.reserve(ROWS * COLS);
+			for (int r = 0; r < ROWS; ++r) {
+				updates.emplace_back(Position{ r, 0 }, std::to_string(r));
+				for (int c = 1; c < COLS; ++c) {
+					updates.emplace_back(Position{ r, c }, "=" + Position{ r, c - 1 }.ToString() + "*2+"
+						+ Position{ r, 0 }.ToString() + "/" + std::to_string(c));
+				}
+			}
+			return updates;
+		};
+		{
+			Sheet sheet;
+			auto updates = make_updates();
+			LOG_DURATION("500k cells: SetCell one by one");
+			for (auto& [pos, text] : updates) {
+				sheet.SetCell(pos, std::move(text));
+			}
+		}
+		for (size_t threads : { 1, 4 }) {
+			Sheet sheet;
+			sheet.SetRecalculationThreads(threads);
+			auto updates = make_updates();
+			LOG_DURATION("500k cells: SetCells, " + std::to_string(threads) + " thread(s)");
+			sheet.SetCells(std::move(updates));
+		}
+	}
+
+	/*
+	 * Агрегаты по диапазонам: 100 формул над столбцом из 5000 чисел —
+	 * SUM(A1:A5000) против цепочки A1+A2+...+A5000.
+	 * Диапазон даёт одно ребро зависимости вместо 5000 и читает ячейки
+	 * подряд в буфер, который суммирует ядро с несколькими аккумуляторами.
+	 */
+	void BenchRangeAggregates() {
+		constexpr int ROWS = 5000;
+		constexpr int FORMULAS = 100;
+		std::string chain = "=";
+		for (int r = 0; r < ROWS; ++r) {
+			chain += (r > 0 ? "+" : "") + Position{ r, 0 }.ToString();
+		}
+		const std::string range = Position{ 0, 0 }.ToString() + ":" + Position{ ROWS - 1, 0 }.ToString();
+
+		for (const auto& [name, text] : { std::pair{ "chain"sv, chain }, std::pair{ "SUM"sv, "=SUM(" + range + ")" },
+			std::pair{ "AVERAGE"sv, "=AVERAGE(" + range + ")" }, std::pair{ "MAX"sv, "=MAX(" + range + ")" } }) {
+			Sheet sheet;
+			for (int r = 0; r < ROWS; ++r) {
+				sheet.SetCell(Position{ r, 0 }, std::to_string(r % 89));
+			}
+			const std::string prefix = "100 x " + std::string(name) + " over 5000 cells";
+			{
+				LOG_DURATION(prefix + ": SetCell");
+				for (int i = 0; i < FORMULAS; ++i) {
+					sheet.SetCell(Position{ i, 1 + i % 10 }, text);
+				}
+			}
+			double checksum = 0;
+			{
+				LOG_DURATION(prefix + ": 20 recalculations");
+				for (int pass = 0; pass < 20; ++pass) {
+					sheet.SetCell(Position{ pass, 0 }, std::to_string(pass));
+					for (int i = 0; i < FORMULAS; ++i) {
+						checksum += std::get<double>(sheet.GetCell(Position{ i, 1 + i % 10 })->GetValue());
+					}
+				}
+			}
+			std::cerr << "  (checksum " << checksum << ")" << std::endl;
+		}
+	}
+
+	/*
+	 * Индекс зависимостей от диапазонов: 10k формул SUM по случайным
+	 * отрезкам 100 столбцов из 10k строк, затем 100k правок ячеек под ними.
+	 * Каждая правка ищет формулы, диапазоны которых покрывают ячейку.
+	 */
+	void BenchRangeIndex() {
+		constexpr int ROWS = 10'000;
+		constexpr int COLS = 100;
+		constexpr int FORMULAS = 10'000;
+		Sheet sheet;
+		std::mt19937 generator(13);
+		std::uniform_int_distribution<int> row_dist(0, ROWS - 1);
+		std::uniform_int_distribution<int> col_dist(0, COLS - 1);
+		{
+			LOG_DURATION("10k range formulas SetCell");
+			for (int i = 0; i < FORMULAS; ++i) {
+				const int col = i % COLS;
+				const CellRange range = CellRange::FromCorners(Position{ row_dist(generator), col },
+					Position{ row_dist(generator), col });
+				sheet.SetCell(Position{ i / COLS, COLS + col }, "=SUM(" + range.ToString() + ")");
+			}
+		}
+		{
+			LOG_DURATION("100k edits under the ranges");
+			for (int step = 0; step < 100'000; ++step) {
+				sheet.SetCell(Position{ row_dist(generator), col_dist(generator) }, std::to_string(step % 10));
+			}
+		}
+		double checksum = 0;
+		{
+			LOG_DURATION("10k range formulas evaluation");
+			for (int i = 0; i < FORMULAS; ++i) {
+				checksum += std::get<double>(sheet.GetCell(Position{ i / COLS, COLS + i % COLS })->GetValue());
+			}
+		}
+		std::cerr << "  (checksum " << checksum << ")" << std::endl;
+	}
+
+	/*
+	 * Диапазоны, начинающиеся в одном столбце: k столбцов формул
+	 * =SUM(A1:Ai) по 4000 строк (4k, 16k и 64k диапазонов), затем 4000
+	 * правок в столбце, который не покрыт ни одним диапазоном.
+	 * Время правки не должно расти с числом диапазонов
+	 */
+	void BenchRangeColumns() {
+		constexpr int ROWS = 4000;
+		for (int columns : { 1, 4, 16 }) {
+			Sheet sheet;
+			const std::string label = std::to_string(columns * ROWS / 1000) + "k range formulas";
+			{
+				LOG_DURATION(label + " SetCell");
+				for (int col = 1; col <= columns; ++col) {
+					for (int row = 0; row < ROWS; ++row) {
+						sheet.SetCell(Position{ row, col }, "=SUM(A1:A" + std::to_string(row + 1) + ")");
+					}
+				}
+			}
+			{
+				LOG_DURATION(label + ", 4000 edits outside the ranges");
+				for (int row = 0; row < ROWS; ++row) {
+					sheet.SetCell(Position{ row, columns + 2 }, std::to_string(row % 10));
+				}
+			}
+		}
+	}
+
+	/*
+	 * Заполнение вниз: 200k формул =A{r}*B{r}+A{r}/(B{r}+1) в столбце C.
+	 * Разбор каждой формулы отдельно против общих шаблонов, затем
+	 * установка тех же формул в лист.
+	 */
+	void BenchFillDown() {
+		constexpr int ROWS = 200'000;
+		std::vector<std::string> texts;
+		texts.reserve(ROWS);
+		for (int r = 0; r < ROWS; ++r) {
+			const std::string row = std::to_string(r % Position::MAX_ROWS + 1);
+			texts.push_back("A" + row + "*B" + row + "+A" + row + "/(B" + row + "+1)");
+		}
+		auto position = [](int r) {
+			return Position{ r % Position::MAX_ROWS, 2 + r / Position::MAX_ROWS };
+		};
+		size_t cells = 0;
+		{
+			LOG_DURATION("200k fill-down formulas: ParseFormula");
+			std::vector<std::unique_ptr<FormulaInterface>> formulas;
+			formulas.reserve(ROWS);
+			for (const std::string& text : texts) {
+				formulas.push_back(ParseFormula(text));
+				cells += formulas.back()->GetReferencedCells().size();
+			}
+		}
+		{
+			LOG_DURATION("200k fill-down formulas: FormulaTemplates");
+			FormulaTemplates templates;
+			std::vector<std::unique_ptr<FormulaInterface>> formulas;
+			formulas.reserve(ROWS);
+			for (int r = 0; r < ROWS; ++r) {
+				formulas.push_back(templates.Parse(texts[r], position(r)));
+				cells += formulas.back()->GetReferencedCells().size();
+			}
+			std::cerr << "  (" << templates.GetSize() << " templates)" << std::endl;
+		}
+		{
+			Sheet sheet;
+			LOG_DURATION("200k fill-down formulas: SetCell");
+			for (int r = 0; r < ROWS; ++r) {
+				sheet.SetCell(position(r), "=" + texts[r]);
+			}
+		}
+		std::cerr << "  (" << cells << " references)" << std::endl;
+	}
+
+	/*
+	 * Столбцовое вычисление формул одного шаблона: 1M экземпляров A*B+C
+	 * по одному (Evaluate) и столбцом (EvaluateColumn), затем пересчёт
+	 * листа 16384x64 таких формул (столбец листа не длиннее MAX_ROWS).
+	 */
+	void BenchColumnEvaluation() {
+		constexpr size_t COUNT = 1'000'000;
+		const auto formula = ParseFormula("A1*B1+C1");
+		std::mt19937 generator(16);
+		std::uniform_real_distribution<double> dist(-100, 100);
+		std::vector<double> args(3 * COUNT);
+		for (double& arg : args) {
+			arg = dist(generator);
+		}
+		std::vector<FormulaInterface::Value> results(COUNT);
+
+		auto report = [](double seconds, size_t cells, double checksum) {
+			std::cerr << "  (" << static_cast<size_t>(cells / seconds) << " cells/s, checksum "
+				<< checksum << ")" << std::endl;
+		};
+		auto checksum = [&] {
+			double sum = 0;
+			for (const auto& result : results) {
+				sum += std::get<double>(result);
+			}
+			return sum;
+		};
+		{
+			LogDuration timer("1M A*B+C: one by one");
+			for (size_t k = 0; k < COUNT; ++k) {
+				const FormulaInterface::Value cell_args[] = { args[k], args[COUNT + k], args[2 * COUNT + k] };
+				results[k] = formula->Evaluate(cell_args, nullptr);
+			}
+			const double seconds = timer.Seconds();
+			report(seconds, COUNT, checksum());
+		}
+		{
+			LogDuration timer("1M A*B+C: column");
+			formula->EvaluateColumn(args.data(), COUNT, results.data());
+			const double seconds = timer.Seconds();
+			report(seconds, COUNT, checksum());
+		}
+
+		constexpr int COLS = 64;
+		Sheet sheet;
+		for (int r = 0; r < Position::MAX_ROWS; ++r) {
+			const std::string row = std::to_string(r + 1);
+			for (int c = 0; c < 3; ++c) {
+				sheet.SetCell(Position{ r, c }, std::to_string(r % 97 + c));
+			}
+			for (int c = 3; c < 3 + COLS; ++c) {
+				sheet.SetCell(Position{ r, c }, "=A" + row + "*B" + row + "+C" + row + "*" + std::to_string(c));
+			}
+		}
+		for (int round = 0; round < 2; ++round) {
+			for (int r = 0; r < Position::MAX_ROWS; ++r) {
+				sheet.SetCell(Position{ r, 0 }, std::to_string(r % 89 + round));
+			}
+			LogDuration timer("16384x64 A*B+C: sheet recalculation");
+			sheet.Recalculate();
+			const double seconds = timer.Seconds();
+			report(seconds, size_t{ Position::MAX_ROWS } * COLS,
+				std::get<double>(sheet.GetCell(Position{ Position::MAX_ROWS - 1, COLS + 2 })->GetValue()));
+		}
+	}
+
+	/*
+	 * Время жизни деревьев: 200k случайных формул глубины 4 разбираются
+	 * и хранятся одновременно, затем уничтожаются все разом.
+	 * Дерево формулы — один блок узлов, так что обе фазы
+	 * упираются в разбор и одну аллокацию на формулу.
+	 */
+	void BenchAstLifetime() {
+		std::mt19937 generator(17);
+		std::vector<std::string> texts;
+		for (int i = 0; i < 200'000; ++i) {
+			texts.push_back(RandomExpression(generator, 4));
+		}
+
+		std::vector<FormulaAST> asts;
+		asts.reserve(texts.size());
+		{
+			LOG_DURATION("200k formulas: parse and keep");
+			for (const std::string& text : texts) {
+				asts.push_back(ParseFormulaAST(text));
+			}
+		}
+		{
+			LOG_DURATION("200k formulas: destroy");
+			asts.clear();
+		}
+	}
+
+	/*
+	 * Память ячеек: 10M пустых ячеек в блочном хранилище, затем 10M
+	 * числовых и 10M коротких текстовых ячеек на листе (16384 x 611).
+	 * Прирост резидентной памяти делится на число ячеек.
+	 */
+	void BenchCellMemory() {
+		constexpr int COLS = 611;
+		constexpr size_t CELLS = size_t{ Position::MAX_ROWS } * COLS;
+		std::cerr << "  (sizeof(Cell) = " << sizeof(Cell) << ")" << std::endl;
+
+		auto report = [](std::optional<size_t> before) {
+			const std::optional<size_t> after = ResidentBytes();
+			if (before && after) {
+				std::cerr << "  (" << static_cast<double>(*after - *before) / CELLS << " bytes/cell)" << std::endl;
+			}
+		};
+		{
+			auto storage = CreateCellStorage(StorageType::Tiled);
+			const std::optional<size_t> before = ResidentBytes();
+			{
+				LOG_DURATION("10M empty cells");
+				for (int r = 0; r < Position::MAX_ROWS; ++r) {
+					for (int c = 0; c < COLS; ++c) {
+						storage->Emplace(Position{ r, c });
+					}
+				}
+			}
+			report(before);
+		}
+		for (const auto& [name, make_text] : {
+			std::pair{ "10M numeric cells"sv, +[](int r, int c) { return std::to_string(r * COLS + c); } },
+			std::pair{ "10M short text cells"sv, +[](int r, int c) { return "x" + std::to_string(c); } },
+			}) {
+			Sheet sheet;
+			const std::optional<size_t> before = ResidentBytes();
+			{
+				LOG_DURATION(name);
+				for (int r = 0; r < Position::MAX_ROWS; ++r) {
+					for (int c = 0; c < COLS; ++c) {
+						sheet.SetCell(Position{ r, c }, make_text(r, c));
+					}
+				}
+			}
+			report(before);
+		}
+	}
+
+	/*
+	 * Формулы, читающие числовой текст: 1M формул =A*2+1 над
+	 * столбцом A из 16384 чисел в записи, которую нельзя восстановить
+	 * по значению ("12.50"), — такой текст хранится как есть.
+	 */
+	void BenchNumericText() {
+		constexpr int COLS = 61;
+		Sheet sheet;
+		for (int r = 0; r < Position::MAX_ROWS; ++r) {
+			sheet.SetCell(Position{ r, 0 }, std::to_string(r) + ".50");
+			const std::string formula = "=A" + std::to_string(r + 1) + "*2+1";
+			for (int c = 1; c <= COLS; ++c) {
+				sheet.SetCell(Position{ r, c }, formula);
+			}
+		}
+		auto read_all = [&] {
+			double sum = 0;
+			for (int r = 0; r < Position::MAX_ROWS; ++r) {
+				for (int c = 1; c <= COLS; ++c) {
+					sum += std::get<double>(sheet.GetCell(Position{ r, c })->GetValue());
+				}
+			}
+			return sum;
+		};
+		std::cerr << "  (" << size_t{ Position::MAX_ROWS } * COLS << " formulas)" << std::endl;
+		{
+			LOG_DURATION("1M formulas over numeric text: first evaluation");
+			std::cerr << "  (sum " << read_all() << ")" << std::endl;
+		}
+		for (int round = 0; round < 3; ++round) {
+			for (int r = 0; r < Position::MAX_ROWS; ++r) {
+				sheet.SetCell(Position{ r, 0 }, std::to_string(r + round) + ".50");
+			}
+			LOG_DURATION("1M formulas over numeric text: recalculation");
+			std::cerr << "  (sum " << read_all() << ")" << std::endl;
+		}
+		{
+			LOG_DURATION("16M reads of numeric text cells: GetValue");
+			double sum = 0;
+			for (int round = 0; round < 1000; ++round) {
+				for (int r = 0; r < Position::MAX_ROWS; ++r) {
+					sum += std::get<double>(sheet.GetCell(Position{ r, 0 })->GetValue());
+				}
+			}
+			std::cerr << "  (sum " << sum << ")" << std::endl;
+		}
+	}
+
+	/*
+	 * Память текстового листа с повторяющимися подписями: 5M ячеек
+	 * с текстами из словаря в 1000 значений, без интернирования и с ним.
+	 */
+	void BenchTextInterning() {
+		constexpr int COLS = 306;
+		constexpr size_t CELLS = size_t{ Position::MAX_ROWS } * COLS;
+		constexpr int VOCABULARY = 1000;
+		std::vector<std::string> vocabulary;
+		vocabulary.reserve(VOCABULARY);
+		for (int i = 0; i < VOCABULARY; ++i) {
+			vocabulary.push_back("Category #" + std::to_string(i) + " (synthetic label)");
+		}
+		std::mt19937 generator(42);
+		std::uniform_int_distribution<int> choice(0, VOCABULARY - 1);
+
+		for (bool interning : { false, true }) {
+			Sheet sheet;
+			sheet.SetTextInterning(interning);
+			const std::optional<size_t> before = ResidentBytes();
+			{
+				LOG_DURATION(interning ? "5M text cells: interned"sv : "5M text cells: separate copies"sv);
+				for (int r = 0; r < Position::MAX_ROWS; ++r) {
+					for (int c = 0; c < COLS; ++c) {
+						sheet.SetCell(Position{ r, c }, vocabulary[choice(generator)]);
+					}
+				}
+			}
+			const std::optional<size_t> after = ResidentBytes();
+			if (before && after) {
+				std::cerr << "  (" << static_cast<double>(*after - *before) / CELLS << " bytes/cell, "
+					<< sheet.GetInternedTextCount() << " interned texts)" << std::endl;
+			}
+		}
+	}
+
+	/*
+	 * Вывод текстов листа из 1M формул (16384x61, заполнение вниз):
+	 * GetText каждой формулы и PrintTexts, по три раза подряд.
+	 */
+	void BenchFormulaText() {
+		constexpr int COLS = 61;
+		Sheet sheet;
+		for (int r = 0; r < Position::MAX_ROWS; ++r) {
+			const std::string row = std::to_string(r + 1);
+			for (int c = 2; c < 2 + COLS; ++c) {
+				sheet.SetCell(Position{ r, c }, "=(A" + row + "*2.5+B" + row + ")/3-SUM(A" + row + ":B" + row + ")");
+			}
+		}
+		for (int round = 0; round < 3; ++round) {
+			LOG_DURATION("1M formulas: GetText");
+			size_t total = 0;
+			for (int r = 0; r < Position::MAX_ROWS; ++r) {
+				for (int c = 2; c < 2 + COLS; ++c) {
+					total += sheet.GetCell(Position{ r, c })->GetText().size();
+				}
+			}
+			std::cerr << "  (" << total << " bytes)" << std::endl;
+		}
+		for (int round = 0; round < 3; ++round) {
+			std::ostringstream output;
+			LOG_DURATION("1M formulas: PrintTexts");
+			sheet.PrintTexts(output);
+		}
+	}
+
+	/*
+	 * Скорость вывода листа в MB/s: PrintValues и PrintTexts плотного
+	 * листа 2000x100 (числа, текст, формулы) и разреженного 16384x1000,
+	 * где занята примерно одна позиция из ста.
+	 */
+	void BenchPrint() {
+		auto fill_dense = [](Sheet& sheet) {
+			for (int r = 0; r < 2000; ++r) {
+				const std::string row = std::to_string(r + 1);
+				for (int c = 0; c < 100; ++c) {
+					switch (c % 4) {
+					case 0:
+						sheet.SetCell(Position{ r, c }, std::to_string(r * 0.37 + c));
+						break;
+					case 1:
+						sheet.SetCell(Position{ r, c }, "label " + std::to_string(c));
+						break;
+					default:
+						sheet.SetCell(Position{ r, c }, "=" + Position{ r, c - c % 4 }.ToString() + "/" + std::to_string(c));
+						break;
+					}
+				}
+			}
+		};
+		auto fill_sparse = [](Sheet& sheet) {
+			for (Position pos : RandomPositions(163'840, Position::MAX_ROWS, 1000)) {
+				sheet.SetCell(pos, pos.row % 2 == 0 ? std::to_string(pos.col * 0.5) : "sparse text");
+			}
+		};
+		for (StorageType type : { StorageType::Tiled, StorageType::Hash, StorageType::FlatHash }) {
+			for (const auto& [set_name, fill] : {
+				std::pair{ "dense 2000x100"sv, +fill_dense },
+				std::pair{ "sparse 16384x1000"sv, +fill_sparse },
+				}) {
+				Sheet sheet(type);
+				fill(sheet);
+				sheet.Recalculate();
+				for (bool texts : { false, true }) {
+					const std::string name = std::string(StorageName(type)) + " " + std::string(set_name)
+						+ (texts ? " PrintTexts" : " PrintValues");
+					size_t bytes = 0;
+					const auto start = std::chrono::steady_clock::now();
+					for (int round = 0; round < 5; ++round) {
+						std::ostringstream output;
+						texts ? sheet.PrintTexts(output) : sheet.PrintValues(output);
+						bytes += output.str().size();
+					}
+					const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+					std::cerr << name << ": " << bytes / elapsed.count() / 1e6 << " MB/s" << std::endl;
+				}
+			}
+		}
+	}
+
+	/*
+	 * Масштабирование PrintValuesParallel по числу потоков на вычисленном
+	 * листе 16384x40 (числа и формулы): экспорт вместе с пересчётом
+	 * после смены входов и повторный экспорт уже вычисленного листа
+	 */
+	void BenchParallelExport() {
+		constexpr int ROWS = Position::MAX_ROWS;
+		constexpr int COLS = 40;
+		Sheet sheet;
+		for (int r = 0; r < ROWS; ++r) {
+			sheet.SetCell(Position{ r, 0 }, std::to_string(r % 97));
+			const std::string a0 = Position{ r, 0 }.ToString();
+			for (int c = 1; c < COLS; ++c) {
+				sheet.SetCell(Position{ r, c }, "=" + a0 + "/" + std::to_string(c + 6) + "+" + std::to_string(c));
+			}
+		}
+
+		for (size_t threads : { 1, 2, 4, 8 }) {
+			sheet.SetRecalculationThreads(threads);
+			for (int r = 0; r < ROWS; ++r) {
+				sheet.SetCell(Position{ r, 0 }, std::to_string((r + threads) % 97));
+			}
+			for (bool recalculated : { false, true }) {
+				std::ostringstream output;
+				const auto start = std::chrono::steady_clock::now();
+				sheet.PrintValuesParallel(output);
+				const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+				std::cerr << threads << " thread(s), " << (recalculated ? "computed sheet" : "with recalculation")
+					<< ": " << elapsed.count() * 1000 << " ms, "
+					<< output.str().size() / elapsed.count() / 1e6 << " MB/s" << std::endl;
+			}
+		}
+	}
+
+	const Benchmark BENCHMARKS[] = {
+		{ "storage"sv, BenchStorage },
+		{ "sparse_hash"sv, BenchSparseHash },
+		{ "position_text"sv, BenchPositionText },
+		{ "bulk_load"sv, BenchBulkLoad },
+		{ "formula_import"sv, BenchFormulaImport },
+		{ "invalidation"sv, BenchInvalidation },
+		{ "formula_vm"sv, BenchFormulaVm },
+		{ "error_column"sv, BenchErrorColumn },
+		{ "bound_refs"sv, BenchBoundReferences },
+		{ "deep_chain"sv, BenchDeepChain },
+		{ "parallel_recalc"sv, BenchParallelRecalc },
+		{ "cycle_check"sv, BenchCycleCheck },
+		{ "parse"sv, BenchParseThroughput },
+		{ "batch_load"sv, BenchBatchLoad },
+		{ "ranges"sv, BenchRangeAggregates },
+		{ "range_index"sv, BenchRangeIndex },
+		{ "range_columns"sv, BenchRangeColumns },
+		{ "fill_down"sv, BenchFillDown },
+		{ "column_eval"sv, BenchColumnEvaluation },
+		{ "ast_lifetime"sv, BenchAstLifetime },
+		{ "cell_memory"sv, BenchCellMemory },
+		{ "numeric_text"sv, BenchNumericText },
+		{ "text_interning"sv, BenchTextInterning },
+		{ "formula_text"sv, BenchFormulaText },
+		{ "print"sv, BenchPrint },
+		{ "parallel_export"sv, BenchParallelExport },
+	};
+
+}  // namespace
+
+void RunBenchmarks(std::string_view filter) {
+	for (const auto& benchmark : BENCHMARKS) {
+		if (benchmark.name.find(filter) == std::string_view::npos) {
+			continue;
+		}
+		std::cerr << "== " << benchmark.name << " ==" << std::endl;
+		benchmark.run();
+	}
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <string_view>
+
+// Запускает бенчмарки, в названии которых встречается filter
+// (пустой фильтр — все). Результаты выводятся в std::cerr.
+void RunBenchmarks(std::string_view filter);
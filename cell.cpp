@@ -1,64 +1,64 @@
 #include "cell.h"
 #include "formula.h"
 #include "sheet.h"
+#include "text_pool.h"
+#include "thread_pool.h"
 #include <algorithm>
+#include <array>
+#include <cassert>
+#include <charconv>
 #include <cmath>
+#include <cstring>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <string_view>
+#include <system_error>
 
-/*
- * Интерфейс реализации ячейки (Pimpl)
- */
-class Cell::Impl {
-public:
-	virtual ~Impl() = default;
-	virtual Value GetValue() const = 0;
-	virtual std::string GetText() const = 0;
-	virtual std::vector<Position> GetReferencedCells() const {
-		return {};
-	};
-	virtual void InvalidateCacheImpl() {}
-};
+static_assert(Position::MAX_ROWS <= (1 << 14) && Position::MAX_COLS <= (1 << 14),
+	"Cell packs row and column into 14 bits each");
 
-/*
- * Пустая ячейка
- */
-class Cell::EmptyImpl : public Cell::Impl {
-public:
-	Value GetValue() const override {
-		return 0.0;
-	}
+namespace {
 
-	std::string GetText() const override {
-		return "";
-	}
-};
+	// Кратчайшая запись числа, которую std::from_chars читает обратно
+	// в то же значение. Буфер должен вмещать любую запись double
+	constexpr size_t NUMBER_TEXT_SIZE = 32;
 
-/*
- * Текстовая ячейка
- */
-class Cell::TextImpl : public Cell::Impl {
-private:
-	std::string text_;
+	std::string_view FormatNumber(double value, std::array<char, NUMBER_TEXT_SIZE>& buffer) {
+		const auto result = std::to_chars(buffer.data(), buffer.data() + buffer.size(), value);
+		assert(result.ec == std::errc());
+		return std::string_view(buffer.data(), result.ptr - buffer.data());
+	}
 
-public:
-	explicit TextImpl(std::string text)
-		: text_(std::move(text)) {
+	// Число, если text — кратчайшая запись конечного числа: тогда текст
+	// ячейки восстанавливается по значению, и хранить его не нужно
+	std::optional<double> ParseCanonicalNumber(std::string_view text) {
+		double value = 0;
+		const auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+		if (result.ec != std::errc() || result.ptr != text.data() + text.size() || !std::isfinite(value)) {
+			return std::nullopt;
+		}
+		std::array<char, NUMBER_TEXT_SIZE> buffer;
+		if (FormatNumber(value, buffer) != text) {
+			return std::nullopt;
+		}
+		return value;
 	}
 
-	// Возвращает значение.
+	// Значение текста как операнда формулы: число, если текст — число
+	// (с пробелами в конце), #ARITHM! для бесконечного числа, иначе #VALUE!.
 	// Сюда перенесена попытка преобразования текста в число
-	// из CellExpr::Evaluate
-	Value GetValue() const override {
+	// из CellExpr::Evaluate. За text должен следовать нулевой символ
+	FormulaInterface::Value ParseTextNumber(std::string_view text) {
 		// Для пустого - 0.0
-		if (text_.empty()) {
+		if (text.empty()) {
 			return 0.0;
 		}
 
 		// Для состоящего из одного префикса - 0.0
-		std::string_view content = text_;
+		std::string_view content = text;
 		if (content[0] == ESCAPE_SIGN) {
 			content.remove_prefix(1);
 			if (content.empty()) {
@@ -79,62 +79,247 @@ public:
 			return num;
 		}
 
-		return std::string(content);
+		return FormulaError(FormulaError::Category::Value);
 	}
 
-	std::string GetText() const override {
-		return text_;
+	// Текст, не являющийся числом: его значение — он сам
+	bool IsPlainText(const FormulaInterface::Value& number) {
+		return std::holds_alternative<FormulaError>(number)
+			&& std::get<FormulaError>(number).GetCategory() == FormulaError::Category::Value;
 	}
-};
+
+	// Значение текста без экранирующего символа
+	std::string_view Unescape(std::string_view text) {
+		if (!text.empty() && text[0] == ESCAPE_SIGN) {
+			text.remove_prefix(1);
+		}
+		return text;
+	}
+}  // namespace
 
 /*
- * Формульная ячейка
+ * Данные формульной ячейки
  */
-class Cell::FormulaImpl : public Cell::Impl {
+class Cell::FormulaData {
 private:
 	std::unique_ptr<FormulaInterface> formula_;
+
+	// Лист формулы: по нему собираются значения диапазонов
+	// и берётся пул пересчёта
 	Sheet& sheet_;
 
 	// Кэш значения формулы (оптимизация повторных вычислений)
-	mutable std::optional<Value> cache_;
+	mutable std::optional<FormulaInterface::Value> cache_;
 
-	// Позиции ячеек, на которые ссылается формула (для проверки циклов)
-	std::vector<Position> referenced_cells_;
+	// Уровень в текущем пересчёте; -1 — ячейка в пересчёт не включена
+	mutable int level_ = -1;
+
+	// Ячейки, на которые ссылается формула, в порядке её GetReferencedCells().
+	// Привязываются при установке формулы; лист создаёт их заранее и не
+	// удаляет, пока от них кто-то зависит, поэтому перепривязка не нужна
+	std::vector<Cell*> inputs_;
+
+	// Диапазоны из аргументов функций. Ячейки диапазонов не привязываются:
+	// их значения собираются при вычислении, а связи с ними хранит лист
+	std::vector<CellRange> ranges_;
+
+	// Текст формулы ("=..."), построенный один раз (см. GetText).
+	// Его могут запросить из нескольких потоков одновременно
+	mutable std::once_flag text_once_;
+	mutable std::string text_;
 
 public:
-	explicit FormulaImpl(std::string expression, Sheet& sheet)
-		: formula_(ParseFormula(std::move(expression)))
-		, sheet_(sheet) {
-		referenced_cells_ = formula_->GetReferencedCells();
-		std::sort(referenced_cells_.begin(), referenced_cells_.end());
-		referenced_cells_.erase(std::unique(referenced_cells_.begin(), referenced_cells_.end()), referenced_cells_.end());
+	explicit FormulaData(std::unique_ptr<FormulaInterface> formula, Sheet& sheet)
+		: formula_(std::move(formula))
+		, sheet_(sheet)
+		, ranges_(formula_->GetReferencedRanges()) {
+		const std::vector<Position> referenced_cells = formula_->GetReferencedCells();
+		inputs_.reserve(referenced_cells.size());
+		for (Position pos : referenced_cells) {
+			inputs_.push_back(dynamic_cast<Cell*>(sheet_.GetCell(pos)));
+		}
+	}
+
+	Sheet& GetSheet() const {
+		return sheet_;
+	}
+
+	// Кэш заполняется движком пересчёта (Cell::Recalculate) до чтения
+	FormulaInterface::Value GetNumericValue() const {
+		assert(cache_.has_value());
+		return *cache_;
+	}
+
+	// Текст формулы строится при первом запросе и больше не меняется:
+	// повторный вывод листа только копирует его
+	const std::string& GetText() const {
+		std::call_once(text_once_, [this] {
+			text_ = FORMULA_SIGN + formula_->GetExpression();
+			});
+		return text_;
+	}
+
+	std::vector<Position> GetReferencedCells() const {
+		return formula_->GetReferencedCells();
+	}
+
+	// Сбрасывает кэш значения. Возвращает true, если кэш был заполнен
+	bool InvalidateCache() {
+		const bool was_valid = cache_.has_value();
+		cache_.reset();
+		return was_valid;
+	}
+
+	// Проверяет, нужно ли вычислить значение перед чтением
+	bool IsDirty() const {
+		return !cache_.has_value();
+	}
+
+	// Отмечает ячейку для пересчёта. Возвращает false, если кэш заполнен
+	// или ячейка уже отмечена в текущем проходе
+	bool Schedule() const {
+		if (cache_.has_value() || level_ >= 0) {
+			return false;
+		}
+		level_ = 0;
+		return true;
+	}
+
+	// Уровень ячейки в текущем пересчёте (см. Cell::RecalculateCells)
+	int GetLevel() const {
+		return level_;
+	}
+
+	void SetLevel(int level) const {
+		level_ = level;
+	}
+
+	// Ячейки, значения которых нужны для вычисления
+	const std::vector<Cell*>& GetInputs() const {
+		return inputs_;
 	}
 
-	Value GetValue() const override {
-		if (!cache_.has_value()) {
-			FormulaInterface::Value result = formula_->Evaluate(sheet_);
+	// Диапазоны, значения ячеек которых нужны для вычисления
+	const std::vector<CellRange>& GetRanges() const {
+		return ranges_;
+	}
 
-			// Преобразуем FormulaInterface::Value в CellInterface::Value
-			if (std::holds_alternative<double>(result)) {
-				cache_ = std::get<double>(result);
+	// Вычисляет значение по уже вычисленным входам и заполняет кэш.
+	// При параллельном пересчёте вызывается из разных потоков для разных
+	// ячеек одного уровня: каждая пишет только свой кэш и читает кэши
+	// входов, вычисленных на предыдущих уровнях
+	void Evaluate() const {
+		cache_ = Calculate();
+		level_ = -1;
+	}
+
+	// Общая программа формул одного шаблона (FormulaInterface::GetColumnProgram)
+	const void* GetColumnProgram() const {
+		return ranges_.empty() ? formula_->GetColumnProgram() : nullptr;
+	}
+
+	// Вычисляет формулы ячеек cells с той же GetColumnProgram(), что у этой
+	// (включая её саму), одной программой над столбцами аргументов.
+	// Аргументы всех формул собираются по столбцам (порядок ссылок у формул
+	// одного шаблона общий), и программа проходит по ним один раз.
+	// Формулы с ошибкой в аргументах вычисляются по одной: у них ошибка
+	// зависит от порядка вычисления
+	void EvaluateColumn(const Cell* const* cells, size_t count) const {
+		const size_t arg_count = inputs_.size();
+		thread_local std::vector<double> args;
+		thread_local std::vector<const FormulaData*> column;
+		thread_local std::vector<FormulaInterface::Value> results;
+		args.resize(arg_count * count);
+		column.clear();
+		for (size_t k = 0; k < count; ++k) {
+			const FormulaData& formula = *cells[k]->formula_;
+			assert(formula.GetColumnProgram() == GetColumnProgram());
+			bool has_error = false;
+			for (size_t i = 0; i < arg_count; ++i) {
+				const Cell* input = formula.inputs_[i];
+				const FormulaInterface::Value value = input ? input->ReadNumericValue() : 0.0;
+				if (std::holds_alternative<FormulaError>(value)) {
+					has_error = true;
+					break;
+				}
+				args[i * count + column.size()] = std::get<double>(value);
+			}
+			if (has_error) {
+				formula.Evaluate();
 			}
 			else {
-				cache_ = std::get<FormulaError>(result);
+				column.push_back(&formula);
 			}
 		}
-		return *cache_;
-	}
 
-	std::string GetText() const override {
-		return FORMULA_SIGN + formula_->GetExpression();
+		// Сжимаем столбцы аргументов до числа вычисляемых формул
+		const size_t size = column.size();
+		for (size_t i = 1; size < count && i < arg_count; ++i) {
+			std::copy(args.begin() + i * count, args.begin() + i * count + size, args.begin() + i * size);
+		}
+		results.resize(size);
+		formula_->EvaluateColumn(args.data(), size, results.data());
+		for (size_t k = 0; k < size; ++k) {
+			column[k]->cache_ = results[k];
+			column[k]->level_ = -1;
+		}
 	}
 
-	std::vector<Position> GetReferencedCells() const override {
-		return referenced_cells_;
+private:
+	// Вычисляет формулу по значениям привязанных ячеек, без поиска по листу.
+	// Все входы к этому моменту уже вычислены
+	FormulaInterface::Value Calculate() const {
+		constexpr size_t INLINE_ARGS = 16;
+		std::array<FormulaInterface::Value, INLINE_ARGS> inline_args;
+		std::vector<FormulaInterface::Value> heap_args;
+		FormulaInterface::Value* args = inline_args.data();
+		if (inputs_.size() > INLINE_ARGS) {
+			heap_args.resize(inputs_.size());
+			args = heap_args.data();
+		}
+
+		for (size_t i = 0; i < inputs_.size(); ++i) {
+			args[i] = inputs_[i] ? inputs_[i]->ReadNumericValue() : FormulaInterface::Value(0.0);
+		}
+		if (ranges_.empty()) {
+			return formula_->Evaluate(args, nullptr);
+		}
+
+		// Значения всех диапазонов собираются подряд в буфер потока;
+		// указатели на его части раздаются, когда буфер больше не растёт
+		thread_local std::vector<double> buffer;
+		buffer.clear();
+		std::vector<RangeValues> ranges(ranges_.size());
+		for (size_t i = 0; i < ranges_.size(); ++i) {
+			const size_t begin = buffer.size();
+			ranges[i].error = GatherRange(ranges_[i], buffer);
+			ranges[i].count = buffer.size() - begin;
+		}
+		size_t offset = 0;
+		for (RangeValues& range : ranges) {
+			range.values = buffer.data() + offset;
+			offset += range.count;
+		}
+		return formula_->Evaluate(args, ranges.data());
 	}
 
-	void InvalidateCacheImpl() override {
-		cache_.reset();
+	// Дописывает в buffer числа из непустых ячеек диапазона, по строкам.
+	// Возвращает ошибку одной из ячеек, если она есть
+	std::optional<FormulaError> GatherRange(CellRange range, std::vector<double>& buffer) const {
+		std::optional<FormulaError> error;
+		sheet_.ForEachCellInRange(range, [&](Position, const Cell& cell) {
+			if (error || cell.IsEmpty()) {
+				return;
+			}
+			const FormulaInterface::Value value = cell.ReadNumericValue();
+			if (std::holds_alternative<double>(value)) {
+				buffer.push_back(std::get<double>(value));
+			}
+			else {
+				error = std::get<FormulaError>(value);
+			}
+			});
+		return error;
 	}
 };
 
@@ -142,42 +327,336 @@ public:
  * Реализация класса Cell
  */
 
-Cell::Cell(Sheet& sheet)
-	: impl_(std::make_unique<EmptyImpl>())
-	, sheet_(sheet) {
+Cell::Cell(Position pos)
+	: number_(0)
+	, row_(static_cast<std::uint32_t>(pos.row))
+	, col_(static_cast<std::uint32_t>(pos.col))
+	, kind_(static_cast<std::uint32_t>(Kind::Empty)) {
+	assert(pos.IsValid());
 }
 
 // Деструктор вынесен сюда,
-// иначе тренажер не может обработать cell.h с неполной реализацией Cell::Impl
-Cell::~Cell() = default;
+// иначе тренажер не может обработать cell.h с неполной реализацией Cell::FormulaData
+Cell::~Cell() {
+	Reset();
+}
+
+Cell::Kind Cell::GetKind() const {
+	return static_cast<Kind>(kind_);
+}
 
-void Cell::Set(std::string text) {
+Cell::FormulaData* Cell::GetFormula() const {
+	return GetKind() == Kind::Formula ? formula_ : nullptr;
+}
+
+void Cell::Reset() {
+	switch (GetKind()) {
+	case Kind::Text:
+		TextPool::Release(text_);
+		break;
+	case Kind::Formula:
+		delete formula_;
+		break;
+	default:
+		break;
+	}
+	number_ = 0;
+	kind_ = static_cast<std::uint32_t>(Kind::Empty);
+}
+
+void Cell::Set(std::string text, Sheet& sheet) {
+	if (IsFormulaText(text)) {
+		Set(ParseFormula(text.substr(1)), sheet);
+		return;
+	}
+
+	Reset();
 	if (text.empty()) {
-		impl_ = std::make_unique<EmptyImpl>();
 		return;
 	}
 
-	if (IsFormulaText(text)) {
-		try {
-			impl_ = std::make_unique<FormulaImpl>(std::move(text.substr(1)), sheet_);
-			return;
-		}
-		catch (const FormulaException&) {
-			throw;
-		}
+	if (const std::optional<double> number = ParseCanonicalNumber(text)) {
+		number_ = *number;
+		kind_ = static_cast<std::uint32_t>(Kind::Number);
+		return;
+	}
+
+	// Текст уже есть в таблице листа: он разобран, берём запись
+	TextPool* pool = sheet.GetTextPool();
+	if (TextPool::Entry* entry = pool ? pool->Acquire(text) : nullptr) {
+		text_ = entry;
+		kind_ = static_cast<std::uint32_t>(Kind::Text);
+		return;
+	}
+
+	FormulaInterface::Value number = ParseTextNumber(text);
+	if (IsPlainText(number) && text.size() <= SHORT_TEXT_SIZE && text.find('\0') == std::string::npos) {
+		std::memset(short_text_, 0, SHORT_TEXT_SIZE);
+		std::memcpy(short_text_, text.data(), text.size());
+		kind_ = static_cast<std::uint32_t>(Kind::ShortText);
 	}
+	else {
+		text_ = pool ? pool->Insert(std::move(text), number) : TextPool::MakeEntry(std::move(text), number);
+		kind_ = static_cast<std::uint32_t>(Kind::Text);
+	}
+}
 
-	impl_ = std::make_unique<TextImpl>(std::move(text));
+void Cell::Set(std::unique_ptr<FormulaInterface> formula, Sheet& sheet) {
+	// Данные создаются до сброса: при исключении ячейка не меняется
+	auto data = std::make_unique<FormulaData>(std::move(formula), sheet);
+	Reset();
+	formula_ = data.release();
+	kind_ = static_cast<std::uint32_t>(Kind::Formula);
 }
 
 void Cell::Clear() {
-	Set("");  // используем Set для корректной очистки зависимостей
+	Reset();
 }
 
 Cell::Value Cell::GetValue() const {
-	return impl_->GetValue();
+	switch (GetKind()) {
+	case Kind::Empty:
+		return 0.0;
+	case Kind::Number:
+		return number_;
+	case Kind::ShortText:
+	case Kind::Text:
+		return GetTextValue();
+	case Kind::Formula:
+		break;
+	}
+
+	FormulaInterface::Value value = GetNumericValue();
+	if (std::holds_alternative<double>(value)) {
+		return std::get<double>(value);
+	}
+	return std::get<FormulaError>(value);
+}
+
+Cell::Value Cell::GetTextValue() const {
+	if (const std::optional<std::string_view> text = GetTextValueView()) {
+		return std::string(*text);
+	}
+	if (std::holds_alternative<double>(text_->number)) {
+		return std::get<double>(text_->number);
+	}
+	return std::get<FormulaError>(text_->number);
+}
+
+FormulaInterface::Value Cell::GetNumericValue() const {
+	if (IsDirty()) {
+		Recalculate();
+	}
+	return ReadNumericValue();
+}
+
+FormulaInterface::Value Cell::ReadNumericValue() const {
+	switch (GetKind()) {
+	case Kind::Empty:
+		return 0.0;
+	case Kind::Number:
+		return number_;
+	case Kind::ShortText:
+		return FormulaError(FormulaError::Category::Value);
+	case Kind::Text:
+		return text_->number;
+	case Kind::Formula:
+		return formula_->GetNumericValue();
+	}
+	assert(false);
+	return 0.0;
+}
+
+void Cell::Recalculate() const {
+	RecalculateCells({ this }, formula_->GetSheet().GetRecalculationPool());
+}
+
+void Cell::RecalculateCells(const std::vector<const Cell*>& cells, ThreadPool* pool) {
+	std::vector<const Cell*> order = CollectDirtyCells(cells);
+
+	// Раскладываем ячейки по уровням (их вычислил CollectDirtyCells)
+	// подсчётом, в один массив. Ячейки одного уровня друг от друга
+	// не зависят: их можно вычислять столбцами и одновременно
+	std::vector<size_t> level_begin(1, 0);
+	for (const Cell* cell : order) {
+		const size_t level = static_cast<size_t>(cell->formula_->GetLevel());
+		if (level + 1 == level_begin.size()) {
+			level_begin.push_back(0);
+		}
+		++level_begin[level + 1];
+	}
+	for (size_t level = 1; level < level_begin.size(); ++level) {
+		level_begin[level] += level_begin[level - 1];
+	}
+	std::vector<const Cell*> by_level(order.size());
+	{
+		std::vector<size_t> next(level_begin.begin(), level_begin.end() - 1);
+		for (const Cell* cell : order) {
+			by_level[next[cell->formula_->GetLevel()]++] = cell;
+		}
+	}
+
+	constexpr size_t MIN_PARALLEL_CELLS = 1024;
+	if (pool && (pool->GetThreadCount() == 1 || order.size() < MIN_PARALLEL_CELLS)) {
+		pool = nullptr;
+	}
+	for (size_t level = 0; level + 1 < level_begin.size(); ++level) {
+		EvaluateLevel(by_level.data() + level_begin[level], level_begin[level + 1] - level_begin[level], pool);
+	}
+}
+
+void Cell::EvaluateLevel(const Cell** cells, size_t count, ThreadPool* pool) {
+	// Короткие столбцы не окупают сбор аргументов
+	constexpr size_t MIN_COLUMN_CELLS = 16;
+	if (count < MIN_COLUMN_CELLS) {
+		for (size_t i = 0; i < count; ++i) {
+			cells[i]->formula_->Evaluate();
+		}
+		return;
+	}
+
+	// Собираем вместе формулы одной программы: обычно это столбцы,
+	// заполненные вниз, и весь уровень — одна программа
+	std::vector<std::pair<const void*, const Cell*>> programs(count);
+	for (size_t i = 0; i < count; ++i) {
+		programs[i] = { cells[i]->formula_->GetColumnProgram(), cells[i] };
+	}
+	const bool single_program = std::all_of(programs.begin(), programs.end(), [&](const auto& entry) {
+		return entry.first == programs.front().first;
+		});
+	if (!single_program) {
+		// Внутри программы — по адресам ячеек, чтобы обходить память подряд
+		std::sort(programs.begin(), programs.end(), [](const auto& lhs, const auto& rhs) {
+			if (lhs.first != rhs.first) {
+				return std::less<const void*>()(lhs.first, rhs.first);
+			}
+			return std::less<const Cell*>()(lhs.second, rhs.second);
+			});
+		for (size_t i = 0; i < count; ++i) {
+			cells[i] = programs[i].second;
+		}
+	}
+
+	// Отрезки одной программы; для пула — не длиннее CHUNK_SIZE.
+	// Мелкие уровни дешевле вычислить на месте, чем раздавать потокам
+	constexpr size_t CHUNK_SIZE = 256;
+	if (pool && count < 2 * CHUNK_SIZE) {
+		pool = nullptr;
+	}
+	const size_t max_chunk = pool ? CHUNK_SIZE : count;
+	std::vector<std::pair<size_t, size_t>> chunks;
+	for (size_t begin = 0; begin < count;) {
+		size_t end = begin + 1;
+		while (end < count && end - begin < max_chunk && programs[end].first == programs[begin].first) {
+			++end;
+		}
+		chunks.emplace_back(begin, end);
+		begin = end;
+	}
+
+	auto evaluate_chunk = [&](size_t chunk) {
+		const auto [begin, end] = chunks[chunk];
+		if (programs[begin].first && end - begin >= MIN_COLUMN_CELLS) {
+			cells[begin]->formula_->EvaluateColumn(cells + begin, end - begin);
+			return;
+		}
+		for (size_t i = begin; i < end; ++i) {
+			cells[i]->formula_->Evaluate();
+		}
+	};
+	if (pool) {
+		pool->ParallelFor(chunks.size(), evaluate_chunk);
+	}
+	else {
+		for (size_t chunk = 0; chunk < chunks.size(); ++chunk) {
+			evaluate_chunk(chunk);
+		}
+	}
+}
+
+bool Cell::IsDirty() const {
+	const FormulaData* formula = GetFormula();
+	return formula && formula->IsDirty();
+}
+
+std::vector<const Cell*> Cell::CollectDirtyCells(const std::vector<const Cell*>& cells) {
+	// Кадр обхода: ячейка, невычисленные ячейки её диапазонов и номер
+	// следующего входа для просмотра — сначала привязанные входы, затем
+	// ячейки диапазонов
+	struct Frame {
+		const Cell* cell;
+		size_t next_input = 0;
+		std::vector<const Cell*> range_inputs;
+	};
+
+	// Отмечает ячейку для пересчёта (см. FormulaData::Schedule)
+	auto schedule = [](const Cell* cell) {
+		const FormulaData* formula = cell->GetFormula();
+		return formula && formula->Schedule();
+	};
+
+	// Уровень ячейки в пересчёте; -1 — ячейка вычисления не ждёт
+	auto get_level = [](const Cell* cell) {
+		const FormulaData* formula = cell->GetFormula();
+		return formula ? formula->GetLevel() : -1;
+	};
+
+	// Кадры заводятся только для формул: их отмечает schedule
+	auto make_frame = [](const Cell* cell) {
+		Frame frame{ cell, 0, {} };
+		for (CellRange range : cell->formula_->GetRanges()) {
+			cell->formula_->GetSheet().ForEachCellInRange(range, [&frame](Position, const Cell& input) {
+				if (input.IsDirty()) {
+					frame.range_inputs.push_back(&input);
+				}
+				});
+		}
+		return frame;
+	};
+
+	std::vector<const Cell*> order;
+	std::vector<Frame> stack;
+
+	// Обход в глубину по явному стеку. Ячейка попадает в порядок, когда
+	// просмотрены все её входы, — то есть после всех ячеек, от которых зависит.
+	// Уже вычисленные и уже отмеченные ячейки не обходятся повторно.
+	for (const Cell* root : cells) {
+		if (schedule(root)) {
+			stack.push_back(make_frame(root));
+		}
+		while (!stack.empty()) {
+			Frame& frame = stack.back();
+			const auto& inputs = frame.cell->formula_->GetInputs();
+			if (frame.next_input < inputs.size() + frame.range_inputs.size()) {
+				const size_t index = frame.next_input++;
+				const Cell* input = index < inputs.size()
+					? inputs[index] : frame.range_inputs[index - inputs.size()];
+				if (input && schedule(input)) {
+					stack.push_back(make_frame(input));
+				}
+				continue;
+			}
+
+			// Уровень ячейки на единицу больше наибольшего уровня её
+			// невычисленных входов; у вычисленных уровень -1
+			int level = 0;
+			for (const Cell* input : inputs) {
+				if (input) {
+					level = std::max(level, get_level(input) + 1);
+				}
+			}
+			for (const Cell* input : frame.range_inputs) {
+				level = std::max(level, get_level(input) + 1);
+			}
+			frame.cell->formula_->SetLevel(level);
+			order.push_back(frame.cell);
+			stack.pop_back();
+		}
+	}
+	return order;
 }
 
+
 void Cell::PrintValue(std::ostream& output) const {
 	auto value = GetValue();
 	if (std::holds_alternative<std::string>(value)) {
@@ -192,32 +671,141 @@ void Cell::PrintValue(std::ostream& output) const {
 }
 
 std::string Cell::GetText() const {
-	return impl_->GetText();
+	switch (GetKind()) {
+	case Kind::Empty:
+		return "";
+	case Kind::Number: {
+		std::array<char, NUMBER_TEXT_SIZE> buffer;
+		return std::string(FormatNumber(number_, buffer));
+	}
+	case Kind::ShortText:
+		return std::string(short_text_, strnlen(short_text_, SHORT_TEXT_SIZE));
+	case Kind::Text:
+		return text_->text;
+	case Kind::Formula:
+		return formula_->GetText();
+	}
+	assert(false);
+	return "";
+}
+
+std::optional<std::string_view> Cell::GetTextView() const {
+	switch (GetKind()) {
+	case Kind::Empty:
+		return std::string_view();
+	case Kind::Number:
+		return std::nullopt;
+	case Kind::ShortText:
+		return std::string_view(short_text_, strnlen(short_text_, SHORT_TEXT_SIZE));
+	case Kind::Text:
+		return std::string_view(text_->text);
+	case Kind::Formula:
+		return std::string_view(formula_->GetText());
+	}
+	assert(false);
+	return std::nullopt;
+}
+
+std::optional<std::string_view> Cell::GetTextValueView() const {
+	switch (GetKind()) {
+	case Kind::ShortText:
+		return Unescape(std::string_view(short_text_, strnlen(short_text_, SHORT_TEXT_SIZE)));
+	case Kind::Text:
+		if (IsPlainText(text_->number)) {
+			return Unescape(text_->text);
+		}
+		return std::nullopt;
+	default:
+		return std::nullopt;
+	}
 }
 
 std::vector<Position> Cell::GetReferencedCells() const {
-	return impl_->GetReferencedCells();
+	const FormulaData* formula = GetFormula();
+	return formula ? formula->GetReferencedCells() : std::vector<Position>{};
+}
+
+Position Cell::GetPosition() const {
+	return Position{ static_cast<int>(row_), static_cast<int>(col_) };
+}
+
+const std::unordered_set<Cell*>& Cell::GetDependentsCells() const {
+	static const std::unordered_set<Cell*> no_dependents;
+	return dependents_ ? *dependents_ : no_dependents;
+}
+
+const std::vector<Cell*>& Cell::GetInputs() const {
+	static const std::vector<Cell*> no_inputs;
+	const FormulaData* formula = GetFormula();
+	return formula ? formula->GetInputs() : no_inputs;
+}
+
+const std::vector<CellRange>& Cell::GetRanges() const {
+	static const std::vector<CellRange> no_ranges;
+	const FormulaData* formula = GetFormula();
+	return formula ? formula->GetRanges() : no_ranges;
+}
+
+int Cell::GetOrder() const {
+	return order_;
 }
 
-std::unordered_set<Cell*> Cell::GetDependentsCells() const {
-	return dependents_;
+void Cell::SetOrder(int order) {
+	order_ = order;
 }
 
-void Cell::InvalidateCache() {
-	impl_->InvalidateCacheImpl();
-	for (Cell* dependent : dependents_) {
-		dependent->InvalidateCache();
+bool Cell::HasDependents() const {
+	return dependents_ != nullptr;
+}
+
+void Cell::InvalidateCache(const Sheet& sheet) {
+	// Содержимое самой ячейки изменилось — зависимые сбрасываем безусловно
+	if (FormulaData* formula = GetFormula()) {
+		formula->InvalidateCache();
+	}
+	const auto& dependents = GetDependentsCells();
+	std::vector<Cell*> worklist(dependents.begin(), dependents.end());
+	const RangeIndex::Visitor add_to_worklist = [&worklist](Cell* dependent) {
+		worklist.push_back(dependent);
+	};
+	sheet.ForEachRangeDependent(GetPosition(), add_to_worklist);
+
+	// Обход по явному стеку вместо рекурсии. Ячейка без кэша уже была сброшена
+	// ранее вместе со всеми зависимыми, поэтому дальше не распространяем:
+	// каждая ячейка сбрасывается не более одного раза за проход.
+	while (!worklist.empty()) {
+		Cell* cell = worklist.back();
+		worklist.pop_back();
+		FormulaData* formula = cell->GetFormula();
+		if (formula && formula->InvalidateCache()) {
+			const auto& cell_dependents = cell->GetDependentsCells();
+			worklist.insert(worklist.end(), cell_dependents.begin(), cell_dependents.end());
+			sheet.ForEachRangeDependent(cell->GetPosition(), add_to_worklist);
+		}
 	}
 }
 
 void Cell::AddDependentCell(Cell* dependent) {
-	dependents_.insert(dependent);
+	if (!dependents_) {
+		dependents_ = std::make_unique<std::unordered_set<Cell*>>();
+	}
+	dependents_->insert(dependent);
 }
 
 void Cell::RemoveDependentCell(Cell* dependent) {
-	dependents_.erase(dependent);
+	if (!dependents_) {
+		return;
+	}
+	dependents_->erase(dependent);
+	if (dependents_->empty()) {
+		dependents_.reset();
+	}
+}
+
+bool Cell::IsEmpty() const {
+	return GetKind() == Kind::Empty;
 }
 
 bool Cell::IsFormulaText(std::string_view text) {
 	return text.size() > 1 && text[0] == FORMULA_SIGN;
-}
\ No newline at end of file
+}
@@ -1,30 +1,48 @@
 #pragma once
 
 #include "common.h"
+#include "formula.h"
+#include "text_pool.h"
 
+#include <cstdint>
 #include <memory>
+#include <optional>
 #include <unordered_set>
 #include <vector>
 #include <string>
 #include <string_view>
 
 class Sheet;  // Forward declaration
+class ThreadPool;
 
 /*
  * Класс Cell представляет ячейку в электронной таблице.
  * Поддерживает три типа содержимого: пустое, текстовое и формулу.
- * Использует паттерн Pimpl (указатель на интерфейс реализации).
+ * Содержимое хранится прямо в ячейке, в объединении по виду (Kind):
+ * число, текст которого восстанавливается по значению, и короткий текст
+ * не требуют аллокаций; длинный текст и формула — отдельный объект.
+ * Текст разбирается как число один раз, при установке; если лист
+ * интернирует тексты, одинаковые тексты ячеек хранятся один раз.
+ * Множество зависимых ячеек создаётся при появлении первой из них.
+ * Лист ячейка не хранит: его получают методы, которым он нужен.
  */
 class Cell : public CellInterface {
 public:
-    explicit Cell(Sheet& sheet);
+    explicit Cell(Position pos);
     ~Cell();
 
+    Cell(const Cell&) = delete;
+    Cell& operator=(const Cell&) = delete;
+
     // Устанавливает содержимое ячейки.
     // Если текст начинается с '=', интерпретируется как формула.
     // Пустая строка делает ячейку пустой.
     // Бросает FormulaException при синтаксической ошибке.
-    void Set(std::string text);
+    void Set(std::string text, Sheet& sheet);
+
+    // Устанавливает уже разобранную формулу.
+    // Ячейки, на которые она ссылается, должны существовать
+    void Set(std::unique_ptr<FormulaInterface> formula, Sheet& sheet);
 
     // Очищает содержимое ячейки, делает её пустой.
     void Clear();
@@ -33,9 +51,13 @@ public:
     // - текст: строка (без экранирующего символа)
     // - формула: double или FormulaError
     // - пусто: ""
-    // Валидирует кэш ячейки
+    // Если кэш формулы сброшен, сначала пересчитывает её (см. Recalculate)
     Value GetValue() const override;
 
+    // Возвращает значение ячейки как операнда формулы: число
+    // (пустая ячейка — ноль) либо ошибка. Для формулы — кэшированный результат
+    FormulaInterface::Value GetNumericValue() const;
+
     // Выводит значение ячейки в поток
     void PrintValue(std::ostream& output) const;
 
@@ -45,16 +67,49 @@ public:
     // - пусто: ""
     std::string GetText() const override;
 
+    // Текст ячейки, как GetText(), без копирования. Для числа, текст
+    // которого не хранится, — nullopt: его даёт только GetText()
+    std::optional<std::string_view> GetTextView() const;
+
+    // Значение текстовой ячейки — строка из GetValue() — без копирования.
+    // nullopt, если значение ячейки не строка
+    std::optional<std::string_view> GetTextValueView() const;
+
     // Возвращает список позиций ячеек, на которые ссылается формула.
     // Для текстовых и пустых ячеек — пустой вектор.
     // Результат отсортирован и не содержит дубликатов.
     std::vector<Position> GetReferencedCells() const override;
 
+    // Возвращает позицию ячейки на листе. O(1)
+    Position GetPosition() const;
+
     // Возвращает список позиций ячеек, которые завясят от текущей.
-    std::unordered_set<Cell*> GetDependentsCells() const;
+    const std::unordered_set<Cell*>& GetDependentsCells() const;
 
-    // Инвалидирует кэш ячейки и зависимых ячеек (рекурсия)
-    void InvalidateCache();
+    // Возвращает ячейки, на которые ссылается формула, в порядке
+    // GetReferencedCells(). Для текстовых и пустых ячеек — пустой вектор
+    const std::vector<Cell*>& GetInputs() const;
+
+    // Возвращает диапазоны из аргументов функций формулы, как
+    // FormulaInterface::GetReferencedRanges(). Для текстовых и пустых
+    // ячеек — пустой вектор
+    const std::vector<CellRange>& GetRanges() const;
+
+    // Номер ячейки в топологическом порядке листа: у каждой ячейки он
+    // меньше, чем у всех зависящих от неё. Поддерживается листом
+    int GetOrder() const;
+    void SetOrder(int order);
+
+    // Проверяет, есть ли формулы, ссылающиеся на ячейку напрямую.
+    // Формулы, зависящие от неё через диапазон, знает лист
+    // (Sheet::HasRangeDependents)
+    bool HasDependents() const;
+
+    // Инвалидирует кэш ячейки и зависимых ячеек (включая формулы
+    // листа sheet, диапазоны которых содержат ячейку).
+    // Итеративно, без рекурсии; распространение останавливается на ячейках,
+    // кэш которых уже сброшен, поэтому проход линеен по числу сброшенных ячеек
+    void InvalidateCache(const Sheet& sheet);
 
     // Добавляет ячейку в контейнер зависимых ячеек
     void AddDependentCell(Cell* dependent);
@@ -62,21 +117,85 @@ public:
     // Удаляет ячейку из контейнера зависимых ячеек
     void RemoveDependentCell(Cell* dependent);
 
+    // Проверяет, пуста ли ячейка (нет ни текста, ни формулы)
+    bool IsEmpty() const override;
+
+    // Проверяет, ждёт ли формула пересчёта (кэш сброшен)
+    bool IsDirty() const;
+
+    // Пересчитывает невычисленные формулы среди cells и все невычисленные
+    // формулы, от которых они зависят; каждая вычисляется один раз, после
+    // своих входов. Без рекурсии, поэтому глубина цепочки не ограничена стеком.
+    // Если передан пул, граф разбивается на уровни независимых ячеек, и
+    // крупные уровни вычисляются параллельно
+    static void RecalculateCells(const std::vector<const Cell*>& cells, ThreadPool* pool);
+
     // Проверяет, является ли текст формулой: начинается с '=' и длина > 1
     static bool IsFormulaText(std::string_view text);
 
 private:
-    class Impl;
-    class EmptyImpl;
-    class TextImpl;
-    class FormulaImpl;
+    class FormulaData;
 
-private:
-    std::unique_ptr<Impl> impl_;
+    // Вид содержимого ячейки: какое поле объединения занято
+    enum class Kind : std::uint8_t {
+        Empty,
+        Number,     // число; текст ячейки — его кратчайшая запись
+        ShortText,  // текст до SHORT_TEXT_SIZE байт без нулевых символов,
+                    // не являющийся числом
+        Text,       // прочий текст вместе с его значением как операнда
+        Formula,
+    };
+
+    static constexpr size_t SHORT_TEXT_SIZE = 8;
+
+    Kind GetKind() const;
+
+    // Данные формулы либо nullptr, если ячейка — не формула
+    FormulaData* GetFormula() const;
+
+    // Освобождает содержимое; ячейка становится пустой
+    void Reset();
 
-    // Ссылка на лист — нужна для проверки циклических зависимостей
-    Sheet& sheet_;
+    // Значение текстовой ячейки (Kind::ShortText или Kind::Text)
+    Value GetTextValue() const;
 
-    // Ячейки, которые зависят от этой (для инвалидации кэша)
-    std::unordered_set<Cell*> dependents_;
+    // Значение как операнд формулы, без пересчёта: для формулы кэш
+    // должен быть заполнен
+    FormulaInterface::Value ReadNumericValue() const;
+
+    // Пересчитывает формулу и все невычисленные формулы, от которых она
+    // зависит (см. RecalculateCells), с пулом пересчёта листа
+    void Recalculate() const;
+
+    // Вычисляет ячейки одного уровня пересчёта: формулы одного шаблона —
+    // столбцами (см. FormulaInterface::EvaluateColumn), остальные по одной.
+    // С пулом крупный уровень делится на части, которые вычисляются
+    // параллельно. Порядок ячеек в cells меняется
+    static void EvaluateLevel(const Cell** cells, size_t count, ThreadPool* pool);
+
+    // Возвращает невычисленные формулы, от которых зависят значения cells
+    // (включая их самих), в топологическом порядке: входы раньше зависимых
+    static std::vector<const Cell*> CollectDirtyCells(const std::vector<const Cell*>& cells);
+
+private:
+    // Содержимое ячейки; занятое поле определяет kind_
+    union {
+        double number_;                      // Kind::Number, всегда конечное
+        char short_text_[SHORT_TEXT_SIZE];   // Kind::ShortText, дополнен нулями
+        TextPool::Entry* text_;              // Kind::Text
+        FormulaData* formula_;               // Kind::Formula
+    };
+
+    // Ячейки, которые зависят от этой (для инвалидации кэша); nullptr,
+    // пока их нет. Формулы, зависящие от ячейки через диапазон, хранит лист
+    std::unique_ptr<std::unordered_set<Cell*>> dependents_;
+
+    // Позиция ячейки на листе (не меняется за время жизни ячейки) и вид
+    // содержимого, упакованные в одно слово
+    std::uint32_t row_ : 14;
+    std::uint32_t col_ : 14;
+    std::uint32_t kind_ : 4;
+
+    // Номер в топологическом порядке (см. GetOrder)
+    int order_ = 0;
 };
\ No newline at end of file
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <array>
+#include <cstddef>
+#include <cstdint>
 #include <iosfwd>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -19,13 +23,119 @@ struct Position {
     bool IsValid() const;
     std::string ToString() const;
 
+    // Записывает адрес ячейки ("A1") в buffer размером не меньше
+    // MAX_STRING_SIZE и возвращает его длину; для некорректной позиции — 0.
+    // Без аллокаций
+    constexpr size_t ToChars(char* buffer) const;
+
     static Position FromString(std::string_view str);
 
+    // То же, что FromString, без аллокаций
+    static constexpr Position FromChars(std::string_view str);
+
+    // Позиция, упакованная в 28 бит: строка в старших PACK_BITS, столбец
+    // в младших. Для корректных позиций упаковка взаимно однозначна, а
+    // порядок упакованных значений совпадает с operator<, поэтому она
+    // годится в ключ хэширования и сортировки
+    constexpr uint32_t Pack() const;
+    static constexpr Position Unpack(uint32_t key);
+
     static const int MAX_ROWS = 16384;
     static const int MAX_COLS = 16384;
     static const Position NONE;
+
+    static constexpr int PACK_BITS = 14;
+    static constexpr size_t MAX_STRING_SIZE = 8;  // "XFD16384"
 };
 
+namespace position_detail {
+
+    constexpr int LETTERS = 26;
+    constexpr unsigned char DIGIT = 0x80;
+
+    // Значение символа адреса ячейки: буква 'A'..'Z' — номер 1..26,
+    // цифра — DIGIT | цифра, прочие символы — 0
+    constexpr std::array<unsigned char, 256> CHAR_VALUES = [] {
+        std::array<unsigned char, 256> values{};
+        for (int i = 0; i < LETTERS; ++i) {
+            values['A' + i] = static_cast<unsigned char>(i + 1);
+        }
+        for (int i = 0; i < 10; ++i) {
+            values['0' + i] = static_cast<unsigned char>(DIGIT | i);
+        }
+        return values;
+    }();
+
+}  // namespace position_detail
+
+constexpr size_t Position::ToChars(char* buffer) const {
+    if (row < 0 || col < 0 || row >= MAX_ROWS || col >= MAX_COLS) {
+        return 0;
+    }
+    // Буквы и цифры получаются с конца: собираем их задом наперёд
+    char reversed[MAX_STRING_SIZE] = {};
+    size_t letters = 0;
+    for (int c = col; c >= 0; c = c / position_detail::LETTERS - 1) {
+        reversed[letters++] = static_cast<char>('A' + c % position_detail::LETTERS);
+    }
+    size_t size = 0;
+    while (letters > 0) {
+        buffer[size++] = reversed[--letters];
+    }
+    size_t digits = 0;
+    for (int r = row + 1; r > 0; r /= 10) {
+        reversed[digits++] = static_cast<char>('0' + r % 10);
+    }
+    while (digits > 0) {
+        buffer[size++] = reversed[--digits];
+    }
+    return size;
+}
+
+constexpr Position Position::FromChars(std::string_view str) {
+    using position_detail::CHAR_VALUES;
+    using position_detail::DIGIT;
+    constexpr Position none{ -1, -1 };
+
+    // Столбец: от одной до трёх заглавных букв
+    size_t i = 0;
+    int col = 0;
+    for (; i < str.size(); ++i) {
+        const unsigned char value = CHAR_VALUES[static_cast<unsigned char>(str[i])];
+        if (value == 0 || (value & DIGIT) != 0) {
+            break;
+        }
+        if (i == 3) {
+            return none;
+        }
+        col = col * position_detail::LETTERS + value;
+    }
+    // Строка: до пяти цифр без ведущего нуля
+    if (i == 0 || i == str.size() || str[i] == '0' || str.size() - i > 5) {
+        return none;
+    }
+    int row = 0;
+    for (; i < str.size(); ++i) {
+        const unsigned char value = CHAR_VALUES[static_cast<unsigned char>(str[i])];
+        if ((value & DIGIT) == 0) {
+            return none;
+        }
+        row = row * 10 + (value & ~DIGIT);
+    }
+    if (col > MAX_COLS || row > MAX_ROWS) {
+        return none;
+    }
+    return { row - 1, col - 1 };
+}
+
+constexpr uint32_t Position::Pack() const {
+    return static_cast<uint32_t>(row) << PACK_BITS | static_cast<uint32_t>(col);
+}
+
+constexpr Position Position::Unpack(uint32_t key) {
+    return { static_cast<int>(key >> PACK_BITS), static_cast<int>(key & ((1u << PACK_BITS) - 1)) };
+}
+
 struct Size {
     int rows = 0;
     int cols = 0;
@@ -33,6 +143,23 @@ struct Size {
     bool operator==(Size rhs) const;
 };
 
+// Прямоугольный диапазон ячеек, например A1:B10.
+// Углы включаются в диапазон; first — левый верхний, last — правый нижний.
+struct CellRange {
+    Position first;
+    Position last;
+
+    bool operator==(CellRange rhs) const;
+    bool operator<(CellRange rhs) const;
+
+    bool IsValid() const;
+    bool Contains(Position pos) const;
+    std::string ToString() const;
+
+    // Диапазон по двум произвольным углам: B2:A1 — то же, что A1:B2
+    static CellRange FromCorners(Position lhs, Position rhs);
+};
+
 /*
  * Описывает ошибки, которые могут возникнуть при вычислении формулы.
  * Реализация - в structures.cpp
@@ -58,6 +185,15 @@ private:
 
 std::ostream& operator<<(std::ostream& output, FormulaError fe);
 
+// Диапазон как операнд формулы: числа из его непустых ячеек, подряд
+// по строкам, либо ошибка одной из ячеек (тогда values не используется).
+// Текст, не приводимый к числу, — ошибка #VALUE!, как и для одной ячейки
+struct RangeValues {
+    const double* values = nullptr;
+    std::size_t count = 0;
+    std::optional<FormulaError> error;
+};
+
 // Исключение, выбрасываемое при попытке передать в метод некорректную позицию
 class InvalidPositionException : public std::out_of_range {
 public:
@@ -96,6 +232,10 @@ public:
     // содержащий экранирующие символы). В случае формулы - её выражение.
     virtual std::string GetText() const = 0;
 
+    // Проверяет, пуста ли ячейка, — как GetText().empty(), но без копирования
+    // текста
+    virtual bool IsEmpty() const = 0;
+
     // Возвращает список ячеек, которые непосредственно задействованы в данной
     // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек. В случае текстовой ячейки список пуст.
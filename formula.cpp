@@ -5,7 +5,13 @@
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <iterator>
+#include <mutex>
+#include <optional>
 #include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
 
 using namespace std::literals;
 
@@ -15,50 +21,150 @@ std::ostream& operator<<(std::ostream& output, const FormulaError& fe) {
 
 namespace {
 
-	class Formula : public FormulaInterface {
-	public:
-		explicit Formula(std::string expression) try
-			: ast_(ParseFormulaAST(expression)) {
+	// Разобранная формула, общая для формул, отличающихся сдвигом ссылок.
+	// Позиции в дереве — как в тексте формулы ячейки anchor
+	struct FormulaTemplate {
+		FormulaAST ast;
+		Position anchor;
+	};
+
+	std::shared_ptr<const FormulaTemplate> ParseTemplate(const std::string& expression, Position anchor) {
+		try {
+			return std::make_shared<const FormulaTemplate>(FormulaTemplate{ ParseFormulaAST(expression), anchor });
 		}
 		catch (const ParsingError& error) {
 			throw FormulaException(error.what());
 		}
+	}
+
+	class Formula : public FormulaInterface {
+	public:
+		// Формула ячейки anchor по шаблону: её ссылки сдвинуты относительно
+		// шаблона так же, как anchor относительно ячейки шаблона
+		Formula(std::shared_ptr<const FormulaTemplate> formula_template, Position anchor)
+			: template_(std::move(formula_template))
+			, shift_{ anchor.row - template_->anchor.row, anchor.col - template_->anchor.col } {
+		}
 
 		Value Evaluate(const SheetInterface& sheet) const override {
-			try {
-				return ast_.Execute(sheet);
-			}
-			catch (const FormulaError& error) {
-				return error;
-			}
+			return template_->ast.Execute(sheet, shift_);
+		}
+
+		// Порядок аргументов при сдвиге не меняется, поэтому байткод
+		// шаблона годится для всех его формул
+		Value Evaluate(const Value* args, const RangeValues* ranges) const override {
+			return template_->ast.Execute(args, ranges);
+		}
+
+		// Программа шаблона без вызовов функций вычисляется столбцами
+		const void* GetColumnProgram() const override {
+			return template_->ast.IsColumnExecutable() ? template_.get() : nullptr;
+		}
+
+		void EvaluateColumn(const double* args, size_t count, Value* results) const override {
+			template_->ast.ExecuteColumn(args, count, results);
 		}
 
 		std::string GetExpression() const override {
-			std::ostringstream out;
-			ast_.PrintFormula(out);
-			std::string result = out.str();
+			std::string result;
+			template_->ast.PrintFormula(result, shift_);
 			return result;
 		}
 
+		// Список уже отсортирован и без дубликатов: он же задаёт порядок
+		// аргументов для Evaluate(const Value*, const RangeValues*)
 		std::vector<Position> GetReferencedCells() const override {
-			std::vector<Position> cells;
-			for (const Position& pos : ast_.GetCells()) {
-				if (pos.IsValid()) {
-					cells.push_back(pos);
-				}
+			const auto arguments = template_->ast.GetArguments();
+			std::vector<Position> cells(arguments.begin(), arguments.end());
+			for (Position& pos : cells) {
+				pos = ShiftPosition(pos, shift_);
 			}
-
-			// Сортируем и удаляем дубликаты
-			std::sort(cells.begin(), cells.end());
-			cells.erase(unique(cells.begin(), cells.end()), cells.end());
 			return cells;
 		}
 
+		// Порядок тот же, что у ranges в Evaluate(const Value*, const RangeValues*)
+		std::vector<CellRange> GetReferencedRanges() const override {
+			const auto template_ranges = template_->ast.GetRanges();
+			std::vector<CellRange> ranges(template_ranges.begin(), template_ranges.end());
+			for (CellRange& range : ranges) {
+				range = ShiftRange(range, shift_);
+			}
+			return ranges;
+		}
+
 	private:
-		FormulaAST ast_;
+		std::shared_ptr<const FormulaTemplate> template_;
+		Position shift_;
 	};
 }  // namespace
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
-	return std::make_unique<Formula>(std::move(expression));
+	return std::make_unique<Formula>(ParseTemplate(expression, Position{}), Position{});
+}
+
+class FormulaTemplates::Impl {
+public:
+	std::unique_ptr<FormulaInterface> Parse(const std::string& expression, Position anchor) {
+		std::optional<std::string> key = GetTemplateKey(expression, anchor);
+		if (!key) {
+			// Ошибку в тексте сообщит полный разбор
+			return ParseFormula(expression);
+		}
+		{
+			std::lock_guard lock(mutex_);
+			auto it = templates_.find(*key);
+			if (it != templates_.end()) {
+				if (auto formula_template = it->second.lock()) {
+					return std::make_unique<Formula>(std::move(formula_template), anchor);
+				}
+			}
+		}
+
+		// Разбираем без блокировки: другие потоки тем временем
+		// могут разобрать такую же формулу, тогда останется одна из них
+		auto formula_template = ParseTemplate(expression, anchor);
+		std::lock_guard lock(mutex_);
+		templates_[std::move(*key)] = formula_template;
+		if (templates_.size() >= next_cleanup_) {
+			RemoveExpired();
+		}
+		return std::make_unique<Formula>(std::move(formula_template), anchor);
+	}
+
+	size_t GetSize() const {
+		std::lock_guard lock(mutex_);
+		return std::count_if(templates_.begin(), templates_.end(), [](const auto& entry) {
+			return !entry.second.expired();
+			});
+	}
+
+private:
+	// Удаляет шаблоны без формул. Следующая очистка — когда таблица
+	// вырастет вдвое, так что очистки в среднем стоят O(1) на вставку
+	void RemoveExpired() {
+		for (auto it = templates_.begin(); it != templates_.end();) {
+			it = it->second.expired() ? templates_.erase(it) : std::next(it);
+		}
+		next_cleanup_ = std::max(MIN_CLEANUP_SIZE, 2 * templates_.size());
+	}
+
+	static constexpr size_t MIN_CLEANUP_SIZE = 1024;
+
+	mutable std::mutex mutex_;
+	std::unordered_map<std::string, std::weak_ptr<const FormulaTemplate>> templates_;
+	size_t next_cleanup_ = MIN_CLEANUP_SIZE;
+};
+
+FormulaTemplates::FormulaTemplates()
+	: impl_(std::make_unique<Impl>()) {
+}
+
+FormulaTemplates::~FormulaTemplates() = default;
+
+std::unique_ptr<FormulaInterface> FormulaTemplates::Parse(std::string expression, Position anchor) {
+	return impl_->Parse(expression, anchor);
+}
+
+size_t FormulaTemplates::GetSize() const {
+	return impl_->GetSize();
 }
\ No newline at end of file
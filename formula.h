@@ -9,6 +9,9 @@
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Функции SUM, AVERAGE, MIN, MAX, COUNT от выражений и диапазонов:
+//   SUM(A1:B10, C1*2). В диапазоне пустые ячейки пропускаются, отдельная
+//   пустая ячейка — как и везде, ноль
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -26,16 +29,65 @@ public:
     // любая.
     virtual Value Evaluate(const SheetInterface& sheet) const = 0;
 
+    // Вычисляет формулу по готовым значениям ячеек, не обращаясь к листу.
+    // args[i] — значение i-й ячейки из GetReferencedCells() как операнда:
+    // число (пустая ячейка — ноль) либо ошибка.
+    // ranges[i] — значения i-го диапазона из GetReferencedRanges().
+    virtual Value Evaluate(const Value* args, const RangeValues* ranges) const = 0;
+
+    // Общая программа формул одного шаблона (см. FormulaTemplates), которую
+    // можно вычислять сразу для многих формул через EvaluateColumn.
+    // nullptr — формула вычисляется только по одной
+    virtual const void* GetColumnProgram() const = 0;
+
+    // Вычисляет count формул с той же GetColumnProgram(), что у этой, по
+    // числовым значениям их аргументов: args[i * count + k] — значение i-й
+    // ячейки GetReferencedCells() k-й формулы (конечное число; формулы с
+    // ошибкой в аргументах так не вычисляются). results[k] — значение k-й
+    // формулы, то же, что вернул бы Evaluate(const Value*, const RangeValues*)
+    virtual void EvaluateColumn(const double* args, size_t count, Value* results) const = 0;
+
     // Возвращает выражение, которое описывает формулу.
     // Не содержит пробелов и лишних скобок.
     virtual std::string GetExpression() const = 0;
 
     // Возвращает список ячеек, которые непосредственно задействованы в вычислении
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
-    // ячеек.
+    // ячеек. Ячейки диапазонов из аргументов функций сюда не входят.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Возвращает диапазоны из аргументов функций: по возрастанию, без
+    // повторов. Ячейки диапазона не перечисляются по одной.
+    virtual std::vector<CellRange> GetReferencedRanges() const = 0;
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+/*
+ * Общие шаблоны формул листа.
+ * Формулы, которые отличаются только сдвигом ссылок вместе с ячейкой
+ * (=A2*B2 в C2, =A3*B3 в C3, ...), разбираются и компилируются один раз:
+ * шаблон хранит дерево и байткод, а формула — указатель на шаблон и сдвиг
+ * своих ссылок относительно него. Текст и ссылки формулы восстанавливаются
+ * сдвигом, поэтому GetExpression() и GetReferencedCells() те же, что у
+ * ParseFormula. Шаблон ищется по тексту с относительными ссылками,
+ * который строит лексер, без разбора; он живёт, пока есть его формулы.
+ * Методы можно вызывать из нескольких потоков одновременно.
+ */
+class FormulaTemplates {
+public:
+    FormulaTemplates();
+    ~FormulaTemplates();
+
+    // То же, что ParseFormula, для формулы ячейки anchor
+    std::unique_ptr<FormulaInterface> Parse(std::string expression, Position anchor);
+
+    // Число шаблонов, у которых есть формулы
+    size_t GetSize() const;
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> impl_;
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+#define PROFILE_CONCAT_INTERNAL(X, Y) X##Y
+#define PROFILE_CONCAT(X, Y) PROFILE_CONCAT_INTERNAL(X, Y)
+#define UNIQUE_VAR_NAME_PROFILE PROFILE_CONCAT(profileGuard, __LINE__)
+#define LOG_DURATION(x) LogDuration UNIQUE_VAR_NAME_PROFILE(x)
+
+/*
+ * Замер времени выполнения блока кода.
+ * При разрушении выводит в поток затраченное время.
+ */
+class LogDuration {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	explicit LogDuration(std::string_view id, std::ostream& output = std::cerr)
+		: id_(id)
+		, output_(output) {
+	}
+
+	LogDuration(const LogDuration&) = delete;
+	LogDuration& operator=(const LogDuration&) = delete;
+
+	// Возвращает время, прошедшее с момента создания, в секундах
+	double Seconds() const {
+		return std::chrono::duration<double>(Clock::now() - start_time_).count();
+	}
+
+	~LogDuration() {
+		using namespace std::chrono;
+		const auto dur = Clock::now() - start_time_;
+		output_ << id_ << ": " << duration_cast<milliseconds>(dur).count() << " ms" << std::endl;
+	}
+
+private:
+	const std::string id_;
+	std::ostream& output_;
+	const Clock::time_point start_time_ = Clock::now();
+};
@@ -0,0 +1,245 @@
+#include "range_index.h"
+
+#include <cassert>
+#include <utility>
+
+namespace {
+
+	// Финализатор MurmurHash3: ключи соседних узлов различаются младшими
+	// битами строки и столбца, а индекс слота — младшие биты хэша
+	std::uint64_t MixKey(std::uint32_t key) {
+		std::uint64_t hash = key;
+		hash ^= hash >> 33;
+		hash *= 0xff51afd7ed558ccdULL;
+		hash ^= hash >> 33;
+		hash *= 0xc4ceb9fe1a85ec53ULL;
+		hash ^= hash >> 33;
+		return hash;
+	}
+
+}  // namespace
+
+void RangeIndex::Bucket::Add(Cell* cell) {
+	if (count == 0 || dependent == cell) {
+		dependent = cell;
+		++count;
+		return;
+	}
+	if (!others) {
+		others = std::make_unique<std::unordered_map<Cell*, std::uint32_t>>();
+	}
+	++(*others)[cell];
+}
+
+bool RangeIndex::Bucket::Remove(Cell* cell) {
+	if (dependent == cell && count > 0) {
+		if (--count > 0) {
+			return false;
+		}
+		// Первая формула ушла: на её место переезжает любая из остальных
+		if (others && !others->empty()) {
+			const auto it = others->begin();
+			dependent = it->first;
+			count = it->second;
+			others->erase(it);
+		}
+		return count == 0;
+	}
+	assert(others && "Range dependency must be registered");
+	const auto it = others->find(cell);
+	assert(it != others->end() && "Range dependency must be registered");
+	if (--it->second == 0) {
+		others->erase(it);
+	}
+	return false;
+}
+
+template <typename Visit>
+void RangeIndex::Bucket::ForEach(Visit visit) const {
+	for (std::uint32_t i = 0; i < count; ++i) {
+		visit(dependent);
+	}
+	if (others) {
+		for (const auto& [cell, cell_count] : *others) {
+			for (std::uint32_t i = 0; i < cell_count; ++i) {
+				visit(cell);
+			}
+		}
+	}
+}
+
+template <typename Action>
+void RangeIndex::ForEachNode(int first, int last, int leaves, Action action) {
+	// Полуинтервал листьев [begin, end) поднимается к корню; крайние узлы,
+	// не покрытые родителем целиком, и есть канонические
+	int begin = leaves + first;
+	int end = leaves + last + 1;
+	while (begin < end) {
+		if (begin & 1) {
+			action(begin++);
+		}
+		if (end & 1) {
+			action(--end);
+		}
+		begin >>= 1;
+		end >>= 1;
+	}
+}
+
+std::uint32_t RangeIndex::MakeKey(int row_node, int col_node) {
+	return static_cast<std::uint32_t>(row_node) << 16 | static_cast<std::uint32_t>(col_node);
+}
+
+int RangeIndex::GetLevel(int col_node) {
+	int level = 0;
+	while (col_node >>= 1) {
+		++level;
+	}
+	return level;
+}
+
+size_t RangeIndex::Home(std::uint32_t key) const {
+	return static_cast<size_t>(MixKey(key)) & (slots_.size() - 1);
+}
+
+size_t RangeIndex::Next(size_t index) const {
+	return (index + 1) & (slots_.size() - 1);
+}
+
+size_t RangeIndex::FindSlot(std::uint32_t key) const {
+	size_t index = Home(key);
+	for (std::uint32_t distance = 0;; ++distance, index = Next(index)) {
+		const Slot& slot = slots_[index];
+		if (slot.key == key) {
+			return index;
+		}
+		// Ключ стоял бы не дальше от своего слота, чем встреченный
+		if (slot.key == EMPTY || slot.distance < distance) {
+			return slots_.size();
+		}
+	}
+}
+
+RangeIndex::Bucket& RangeIndex::EmplaceBucket(std::uint32_t key) {
+	if (const size_t index = FindSlot(key); index != slots_.size()) {
+		return slots_[index].bucket;
+	}
+	// Заполненность не выше 7/8: длина пробирования остаётся короткой
+	if ((bucket_count_ + 1) * 8 > slots_.size() * 7) {
+		Rehash(slots_.size() * 2);
+	}
+	++bucket_count_;
+	// Robin Hood: новый ключ вытесняет ключи, стоящие ближе к своему слоту.
+	// Пустая корзина встаёт на первое место, где она остановилась бы
+	Slot slot{ key, 0, {} };
+	size_t result = slots_.size();
+	for (size_t index = Home(key);; index = Next(index), ++slot.distance) {
+		Slot& current = slots_[index];
+		if (current.key == EMPTY) {
+			current = std::move(slot);
+			return slots_[result == slots_.size() ? index : result].bucket;
+		}
+		if (current.distance < slot.distance) {
+			std::swap(current, slot);
+			if (result == slots_.size()) {
+				result = index;
+			}
+		}
+	}
+}
+
+void RangeIndex::EraseSlot(size_t index) {
+	// Сдвигаем хвост цепочки на освободившееся место: так не нужны
+	// метки удалённых слотов, и поиск остаётся коротким
+	for (size_t next = Next(index); slots_[next].key != EMPTY && slots_[next].distance > 0;
+		index = next, next = Next(next)) {
+		slots_[index] = std::move(slots_[next]);
+		--slots_[index].distance;
+	}
+	slots_[index] = Slot{};
+	--bucket_count_;
+}
+
+void RangeIndex::Rehash(size_t capacity) {
+	std::vector<Slot> old(capacity);
+	old.swap(slots_);
+	bucket_count_ = 0;
+	for (Slot& slot : old) {
+		if (slot.key != EMPTY) {
+			EmplaceBucket(slot.key) = std::move(slot.bucket);
+		}
+	}
+}
+
+template <typename Visit>
+void RangeIndex::VisitContaining(Position pos, Visit visit) const {
+	if (size_ == 0 || !pos.IsValid()) {
+		return;
+	}
+	const int col_leaf = COL_LEAVES + pos.col;
+	for (int row_node = ROW_LEAVES + pos.row; row_node > 0; row_node >>= 1) {
+		const LevelCounts& counts = level_counts_[row_node];
+		for (int level = 0; level < COL_LEVELS; ++level) {
+			if (counts[level] == 0) {
+				continue;
+			}
+			const size_t index = FindSlot(MakeKey(row_node, col_leaf >> (COL_LEVELS - 1 - level)));
+			if (index != slots_.size() && !visit(slots_[index].bucket)) {
+				return;
+			}
+		}
+	}
+}
+
+void RangeIndex::Add(CellRange range, Cell* dependent) {
+	assert(range.IsValid());
+	if (level_counts_.empty()) {
+		level_counts_.resize(2 * ROW_LEAVES);
+	}
+	ForEachNode(range.first.row, range.last.row, ROW_LEAVES, [&](int row_node) {
+		ForEachNode(range.first.col, range.last.col, COL_LEAVES, [&](int col_node) {
+			Bucket& bucket = EmplaceBucket(MakeKey(row_node, col_node));
+			if (bucket.count == 0) {
+				++level_counts_[row_node][GetLevel(col_node)];
+			}
+			bucket.Add(dependent);
+			});
+		});
+	++size_;
+}
+
+void RangeIndex::Remove(CellRange range, Cell* dependent) {
+	assert(size_ > 0 && "Range dependency must be registered");
+	ForEachNode(range.first.row, range.last.row, ROW_LEAVES, [&](int row_node) {
+		ForEachNode(range.first.col, range.last.col, COL_LEAVES, [&](int col_node) {
+			const size_t index = FindSlot(MakeKey(row_node, col_node));
+			assert(index != slots_.size() && "Range dependency must be registered");
+			if (slots_[index].bucket.Remove(dependent)) {
+				EraseSlot(index);
+				--level_counts_[row_node][GetLevel(col_node)];
+			}
+			});
+		});
+	--size_;
+}
+
+void RangeIndex::ForEachContaining(Position pos, const Visitor& visit) const {
+	VisitContaining(pos, [&visit](const Bucket& bucket) {
+		bucket.ForEach(visit);
+		return true;
+		});
+}
+
+bool RangeIndex::HasContaining(Position pos) const {
+	bool found = false;
+	VisitContaining(pos, [&found](const Bucket&) {
+		// Пустые корзины удаляются
+		found = true;
+		return false;
+		});
+	return found;
+}
+
+size_t RangeIndex::GetSize() const {
+	return size_;
+}
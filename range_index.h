@@ -0,0 +1,130 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+class Cell;
+
+/*
+ * Зависимости формул от диапазонов ячеек.
+ * Формула SUM(A1:A5000) хранит одну запись «диапазон -> формула» вместо
+ * 5000 связей в зависимых ячейках диапазона; ячейка находит формулы,
+ * которые от неё зависят, запросом по своей позиции.
+ *
+ * Записи лежат в двумерном дереве отрезков: диапазон строк раскладывается
+ * на O(log MAX_ROWS) канонических узлов дерева строк, диапазон столбцов —
+ * на O(log MAX_COLS) узлов дерева столбцов, и формула записывается в
+ * корзину каждой пары узлов. Блок ячеек пары целиком лежит в диапазоне,
+ * поэтому столбцы записей при запросе не проверяются.
+ * Запрос проходит 15 узлов строк от листа к корню и в каждом — узлы
+ * столбцов pos на тех уровнях, где у узла строк есть корзины: не больше
+ * 15 * 15 поисков в хэш-таблице независимо от числа диапазонов.
+ * Корзина хранит формулу с числом её записей, так что удаление — поиск
+ * по ключу, а не просмотр корзины. Корзины лежат в хэш-таблице с
+ * открытой адресацией (как FlatHashCellStorage): поиск пары узлов
+ * обычно читает одну кэш-линию и не выделяет память на корзину.
+ */
+class RangeIndex {
+public:
+	using Visitor = std::function<void(Cell*)>;
+
+	void Add(CellRange range, Cell* dependent);
+
+	// Удаляет одну запись с этим диапазоном и этой формулой
+	void Remove(CellRange range, Cell* dependent);
+
+	// Вызывает visit для каждой формулы, диапазон которой содержит pos.
+	// Формула с несколькими такими диапазонами посещается несколько раз
+	void ForEachContaining(Position pos, const Visitor& visit) const;
+
+	// Проверяет, содержит ли pos хотя бы один диапазон
+	bool HasContaining(Position pos) const;
+
+	// Число записей (диапазонов) в индексе
+	size_t GetSize() const;
+
+private:
+	// Формулы пары узлов и число записей каждой из них.
+	// Обычно у блока одна формула: она хранится на месте, остальные —
+	// в хэш-таблице, которая создаётся только для общих блоков
+	struct Bucket {
+		Cell* dependent = nullptr;
+		std::uint32_t count = 0;
+		std::unique_ptr<std::unordered_map<Cell*, std::uint32_t>> others;
+
+		void Add(Cell* cell);
+
+		// Возвращает true, если в корзине не осталось формул
+		bool Remove(Cell* cell);
+
+		template <typename Visit>
+		void ForEach(Visit visit) const;
+	};
+
+	// Узел i дерева из leaves листьев: лист позиции p — узел leaves + p,
+	// у узла i дети 2i и 2i+1, корень — узел 1
+	static constexpr int ROW_LEAVES = Position::MAX_ROWS;
+	static constexpr int COL_LEAVES = Position::MAX_COLS;
+	static_assert((ROW_LEAVES & (ROW_LEAVES - 1)) == 0, "число листьев — степень двойки");
+	static_assert((COL_LEAVES & (COL_LEAVES - 1)) == 0, "число листьев — степень двойки");
+
+	// Уровни дерева столбцов: корень — уровень 0, листья — COL_LEVELS - 1
+	static constexpr int COL_LEVELS = 15;
+	static_assert(COL_LEAVES == 1 << (COL_LEVELS - 1), "листья — последний уровень");
+
+	// Число корзин узла строк на каждом уровне дерева столбцов
+	using LevelCounts = std::array<std::uint16_t, COL_LEVELS>;
+
+	// Вызывает action(node) для канонических узлов отрезка [first, last]
+	template <typename Action>
+	static void ForEachNode(int first, int last, int leaves, Action action);
+
+	// Ключ корзины пары узлов
+	static std::uint32_t MakeKey(int row_node, int col_node);
+
+	// Уровень узла дерева столбцов
+	static int GetLevel(int col_node);
+
+	struct Slot {
+		std::uint32_t key = EMPTY;
+		std::uint32_t distance = 0;  // расстояние от слота, на который указывает хэш
+		Bucket bucket;
+	};
+
+	static constexpr std::uint32_t EMPTY = UINT32_MAX;
+	static constexpr size_t MIN_CAPACITY = 16;
+
+	size_t Home(std::uint32_t key) const;
+	size_t Next(size_t index) const;
+
+	// Индекс слота с ключом key либо slots_.size(), если его нет
+	size_t FindSlot(std::uint32_t key) const;
+
+	// Корзина пары узлов; создаётся пустой, если её нет
+	Bucket& EmplaceBucket(std::uint32_t key);
+
+	// Удаляет слот обратным сдвигом хвоста цепочки
+	void EraseSlot(size_t index);
+
+	void Rehash(size_t capacity);
+
+	// Вызывает visit для корзин, блоки которых содержат pos;
+	// visit возвращает false, чтобы прервать обход
+	template <typename Visit>
+	void VisitContaining(Position pos, Visit visit) const;
+
+private:
+	std::vector<Slot> slots_ = std::vector<Slot>(MIN_CAPACITY);
+	size_t bucket_count_ = 0;
+
+	// По узлу дерева строк; выделяются при первой записи
+	std::vector<LevelCounts> level_counts_;
+	size_t size_ = 0;
+};
@@ -4,11 +4,18 @@
 #include "common.h"
 
 #include <algorithm>
+#include <exception>
 #include <cassert>
+#include <charconv>
+#include <cstring>
 #include <functional>
 #include <iostream>
+#include <locale>
 #include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <unordered_set>
 #include <utility>
 #include <variant>
@@ -16,6 +23,12 @@
 
 using namespace std::literals;
 
+Sheet::Sheet(StorageType storage_type)
+	: cells_(CreateCellStorage(storage_type))
+	, row_counts_(Position::MAX_ROWS)
+	, col_counts_(Position::MAX_COLS) {
+}
+
 void Sheet::SetCell(Position pos, std::string text) {
 
 	// 1. Проверяем корректность позиции
@@ -23,20 +36,23 @@ void Sheet::SetCell(Position pos, std::string text) {
 
 	// 2. Анализируем содержимое: это формула?
 	bool is_formula = Cell::IsFormulaText(text);
+	std::unique_ptr<FormulaInterface> formula;
 	std::vector<Position> new_refs;
+	std::vector<CellRange> new_ranges;
 
 	// 3. Если это формула — парсим и проверяем до любых изменений
 	if (is_formula) {
 		try {
-			// Парсим выражение (без '=')
-			auto formula = ParseFormula(text.substr(1));
+			// Парсим выражение (без '='); разобранная формула устанавливается в ячейку
+			formula = formula_templates_.Parse(text.substr(1), pos);
 			new_refs = formula->GetReferencedCells();
+			new_ranges = formula->GetReferencedRanges();
 
 			// Проверка: не ссылается ли на саму себя?
-			CheckSelfReference(new_refs, pos);
+			CheckSelfReference(new_refs, new_ranges, pos);
 
 			// Проверка: не будет ли циклической зависимости?
-			CheckCircularDependency(new_refs, pos);
+			CheckCircularDependency(new_refs, new_ranges, pos);
 		}
 		catch (const FormulaException&) {
 			// Синтаксическая ошибка в формуле — пробрасываем
@@ -53,36 +69,171 @@ void Sheet::SetCell(Position pos, std::string text) {
 	Cell* cell = GetOrCreateCell(pos);
 
 	// 5. Сохраняем старые зависимости (до изменения)
-	std::vector<Position> old_refs;
-	if (Cell::IsFormulaText(cell->GetText())) {
-		old_refs = cell->GetReferencedCells();
-	}
+	// У ячейки без формулы списки пусты; текст формулы не строится
+	const bool was_empty = cell->IsEmpty();
+	const std::vector<Position> old_refs = cell->GetReferencedCells();
+	const std::vector<CellRange> old_ranges = cell->GetRanges();
 
 	// 6. Создаём пустые ячейки для всех новых ссылок (если ещё не существуют)
 	// Это нужно, чтобы они были доступны при вычислении
 	EnsureCellsExist(new_refs);
 
 	// 7. Устанавливаем новое содержимое ячейки
-	// Может изменить impl_, вызвать InvalidateCache внутри FormulaImpl
-	cell->Set(std::move(text));
+	if (formula) {
+		cell->Set(std::move(formula), *this);
+	}
+	else {
+		cell->Set(std::move(text), *this);
+	}
 
 	// 8. Обновляем граф зависимостей:
 	// - удаляем эту ячейку из dependents_ старых зависимостей
 	// - добавляем в dependents_ новых
 	UpdateDependencies(cell, old_refs, new_refs);
+	UpdateRangeDependencies(cell, old_ranges, new_ranges);
 
 	// 9. Инвалидируем кэш текущей ячейки и всех, кто от неё зависит
-	cell->InvalidateCache();
+	cell->InvalidateCache(*this);
 
 	// 10. Обновляем размер печатной области
-	UpdatePrintSize();
+	if (was_empty && !cell->IsEmpty()) {
+		AddToPrintArea(pos);
+	}
+	else if (!was_empty && cell->IsEmpty()) {
+		RemoveFromPrintArea(pos);
+	}
+}
+
+void Sheet::SetCells(std::vector<CellUpdate> updates) {
+	// 1. Проверяем позиции; при повторе позиции действует последняя запись
+	std::unordered_map<Position, size_t, PositionHash> last_update;
+	for (size_t i = 0; i < updates.size(); ++i) {
+		EnsurePositionValid(updates[i].first);
+		last_update[updates[i].first] = i;
+	}
+	std::vector<PendingCell> pending;
+	pending.reserve(last_update.size());
+	for (size_t i = 0; i < updates.size(); ++i) {
+		if (last_update[updates[i].first] == i) {
+			PendingCell& update = pending.emplace_back();
+			update.pos = updates[i].first;
+			update.text = std::move(updates[i].second);
+		}
+	}
+
+	// 2. Разбираем формулы, по возможности параллельно.
+	// Ошибки запоминаем и сообщаем первую в порядке пакета
+	std::vector<std::exception_ptr> errors(pending.size());
+	auto parse_range = [this, &pending, &errors](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			PendingCell& cell = pending[i];
+			if (!Cell::IsFormulaText(cell.text)) {
+				continue;
+			}
+			try {
+				cell.formula = formula_templates_.Parse(cell.text.substr(1), cell.pos);
+				cell.refs = cell.formula->GetReferencedCells();
+				cell.ranges = cell.formula->GetReferencedRanges();
+			}
+			catch (...) {
+				errors[i] = std::current_exception();
+			}
+		}
+	};
+	constexpr size_t PARSE_CHUNK = 256;
+	if (recalc_pool_ && pending.size() > PARSE_CHUNK) {
+		recalc_pool_->ParallelFor((pending.size() + PARSE_CHUNK - 1) / PARSE_CHUNK, [&](size_t chunk) {
+			parse_range(chunk * PARSE_CHUNK, std::min(pending.size(), (chunk + 1) * PARSE_CHUNK));
+			});
+	}
+	else {
+		parse_range(0, pending.size());
+	}
+	for (const auto& error : errors) {
+		if (error) {
+			std::rethrow_exception(error);
+		}
+	}
+
+	// 3. Один поиск циклов для итогового графа
+	const std::vector<Position> topological_order = CheckBatchCycles(pending);
+
+	// 4. Дальше ошибок нет — применяем пакет.
+	// Сначала очищаем все ячейки пакета и снимаем их старые связи: тогда
+	// граф на каждом шаге — подграф итогового, циклов в нём нет, и
+	// топологический порядок восстанавливается без отказов
+	for (PendingCell& update : pending) {
+		if (Cell* cell = cells_->Find(update.pos)) {
+			update.was_empty = cell->IsEmpty();
+			UpdateDependencies(cell, cell->GetReferencedCells(), {});
+			UpdateRangeDependencies(cell, cell->GetRanges(), {});
+			cell->Clear();
+		}
+	}
+	// Новые ячейки ставим в конец порядка листа в порядке обхода:
+	// между собой они уже упорядочены, а связи от старых ячеек к новым
+	// исправит восстановление порядка ниже. Ячейки, от которых через
+	// диапазон зависят формулы вне пакета, ставим в начало, как входы
+	for (Position pos : topological_order) {
+		if (!cells_->Find(pos)) {
+			cells_->Emplace(pos)->SetOrder(HasRangeDependents(pos) ? --min_order_ : ++max_order_);
+		}
+	}
+	for (const PendingCell& update : pending) {
+		EnsureCellsExist(update.refs);
+	}
+
+	std::vector<Cell*> changed;
+	changed.reserve(pending.size());
+	for (PendingCell& update : pending) {
+		Cell* cell = GetOrCreateCell(update.pos);
+		std::vector<Cell*> sources;
+		auto add_source = [cell, &sources](Position, Cell& ref) {
+			if (ref.GetOrder() > cell->GetOrder()) {
+				sources.push_back(&ref);
+			}
+		};
+		for (Position ref_pos : update.refs) {
+			add_source(ref_pos, *cells_->Find(ref_pos));
+		}
+		for (CellRange range : update.ranges) {
+			cells_->ForEachInRange(range, add_source);
+		}
+		std::sort(sources.begin(), sources.end());
+		sources.erase(std::unique(sources.begin(), sources.end()), sources.end());
+		if (!sources.empty()) {
+			[[maybe_unused]] const bool restored = RestoreOrder(sources, cell);
+			assert(restored && "Batch graph was checked for cycles");
+		}
+
+		if (update.formula) {
+			cell->Set(std::move(update.formula), *this);
+		}
+		else {
+			cell->Set(std::move(update.text), *this);
+		}
+		UpdateDependencies(cell, {}, update.refs);
+		UpdateRangeDependencies(cell, {}, update.ranges);
+
+		if (update.was_empty && !cell->IsEmpty()) {
+			AddToPrintArea(update.pos);
+		}
+		else if (!update.was_empty && cell->IsEmpty()) {
+			RemoveFromPrintArea(update.pos);
+		}
+		changed.push_back(cell);
+	}
+
+	// 5. Сбрасываем кэши: каждая зависимая ячейка — не более одного раза
+	for (Cell* cell : changed) {
+		cell->InvalidateCache(*this);
+	}
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
 	EnsurePositionValid(pos);
 
-	auto it = cells_.find(pos);
-	return (it == cells_.end() || !it->second) ? nullptr : it->second.get();
+	return cells_->Find(pos);
 }
 
 CellInterface* Sheet::GetCell(Position pos) {
@@ -92,20 +243,30 @@ CellInterface* Sheet::GetCell(Position pos) {
 void Sheet::ClearCell(Position pos) {
 	EnsurePositionValid(pos);
 
-	auto it = cells_.find(pos);
-	if (it != cells_.end()) {
-		cells_.erase(it);
-		ShrinkPrintSize();
+	Cell* cell = cells_->Find(pos);
+	if (!cell) {
+		return;
+	}
+	if (!cell->IsEmpty()) {
+		RemoveFromPrintArea(pos);
+	}
+
+	// Ячейка больше ни на кого не ссылается
+	UpdateDependencies(cell, cell->GetReferencedCells(), {});
+	UpdateRangeDependencies(cell, cell->GetRanges(), {});
+
+	if (cell->HasDependents() || HasRangeDependents(pos)) {
+		// На ячейку ссылаются формулы: оставляем пустой объект
+		cell->Clear();
+		cell->InvalidateCache(*this);
+	}
+	else {
+		cells_->Erase(pos);
 	}
 }
 
 Position Sheet::GetPosition(const Cell* cell) const {
-	for (const auto& [pos, ptr] : cells_) {
-		if (ptr.get() == cell) {
-			return pos;
-		}
-	}
-	return Position::NONE;
+	return cell ? cell->GetPosition() : Position::NONE;
 }
 
 Size Sheet::GetPrintableSize() const {
@@ -113,60 +274,322 @@ Size Sheet::GetPrintableSize() const {
 }
 
 void Sheet::PrintValues(std::ostream& output) const {
-	for (int r = 0; r < print_size_.rows; ++r) {
-		PrintRow(r, output, [this](const Cell* cell, std::ostream& os) {
-			cell->PrintValue(os);
-			});
-	}
+	PrintArea(output, [](auto& sink, const Cell& cell) {
+		sink.WriteValue(cell);
+		});
 }
 
 void Sheet::PrintTexts(std::ostream& output) const {
-	for (int r = 0; r < print_size_.rows; ++r) {
-		PrintRow(r, output, [this](const Cell* cell, std::ostream& os) {
-			os << cell->GetText();
-			});
+	PrintArea(output, [](auto& sink, const Cell& cell) {
+		sink.WriteText(cell);
+		});
+}
+
+void Sheet::SetRecalculationThreads(size_t thread_count) {
+	if (thread_count <= 1) {
+		recalc_pool_.reset();
 	}
+	else if (!recalc_pool_ || recalc_pool_->GetThreadCount() != thread_count) {
+		recalc_pool_ = std::make_unique<ThreadPool>(thread_count);
+	}
+}
+
+ThreadPool* Sheet::GetRecalculationPool() const {
+	return recalc_pool_.get();
+}
+
+void Sheet::SetTextInterning(bool enabled) {
+	intern_texts_ = enabled;
+}
+
+TextPool* Sheet::GetTextPool() {
+	return intern_texts_ ? &text_pool_ : nullptr;
+}
+
+size_t Sheet::GetInternedTextCount() const {
+	return text_pool_.GetSize();
+}
+
+void Sheet::Recalculate() {
+	std::vector<const Cell*> dirty;
+	cells_->ForEach([&dirty](Position, Cell& cell) {
+		if (cell.IsDirty()) {
+			dirty.push_back(&cell);
+		}
+		});
+	Cell::RecalculateCells(dirty, recalc_pool_.get());
 }
 
-void Sheet::PrintRow(const int row, std::ostream& output, CellPrinter print_cell) const {
-	for (int c = 0; c < print_size_.cols; ++c) {
-		if (c > 0) {
-			output << "\t";
+void Sheet::ForEachCellInRange(CellRange range, const CellStorage::Visitor& visit) const {
+	cells_->ForEachInRange(range, visit);
+}
+
+void Sheet::ForEachRangeDependent(Position pos, const RangeIndex::Visitor& visit) const {
+	range_dependents_.ForEachContaining(pos, visit);
+}
+
+bool Sheet::HasRangeDependents(Position pos) const {
+	return range_dependents_.HasContaining(pos);
+}
+
+namespace {
+
+	// Форматирование потока по умолчанию: operator<< выводит double
+	// как %g с шестью значащими цифрами, ширина не задана
+	bool HasDefaultFormat(const std::ostream& output) {
+		return output.flags() == (std::ios_base::dec | std::ios_base::skipws)
+			&& output.precision() == 6 && output.width() == 0
+			&& output.getloc() == std::locale::classic();
+	}
+
+	/*
+	 * Буферизованный вывод листа. Символы копируются в блок, который
+	 * пишется в поток целиком; числа форматируются std::to_chars так же,
+	 * как operator<< потока с форматированием по умолчанию.
+	 * Без потока блок растёт, и текст забирается методом Take
+	 */
+	class BufferedSink {
+	public:
+		explicit BufferedSink(std::ostream* output = nullptr)
+			: output_(output)
+			, buffer_(CAPACITY, '\0') {
+		}
+
+		BufferedSink(const BufferedSink&) = delete;
+		BufferedSink& operator=(const BufferedSink&) = delete;
+
+		~BufferedSink() {
+			Flush();
+		}
+
+		void Write(std::string_view text) {
+			// Пустой вид может иметь нулевой data(), а memcpy его не допускает
+			if (text.empty()) {
+				return;
+			}
+			if (text.size() > buffer_.size() - size_) {
+				MakeRoom(text.size());
+				if (text.size() > buffer_.size() - size_) {
+					output_->write(text.data(), static_cast<std::streamsize>(text.size()));
+					return;
+				}
+			}
+			std::memcpy(buffer_.data() + size_, text.data(), text.size());
+			size_ += text.size();
+		}
+
+		void WriteChars(char c, int count) {
+			for (; count > 0; --count) {
+				if (size_ == buffer_.size()) {
+					MakeRoom(1);
+				}
+				buffer_[size_++] = c;
+			}
+		}
+
+		void WriteNumber(double number) {
+			if (buffer_.size() - size_ < NUMBER_SIZE) {
+				MakeRoom(NUMBER_SIZE);
+			}
+			char* begin = buffer_.data() + size_;
+			const auto result = std::to_chars(begin, begin + NUMBER_SIZE, number, std::chars_format::general, 6);
+			size_ += static_cast<size_t>(result.ptr - begin);
+		}
+
+		void WriteValue(const Cell& cell) {
+			if (const std::optional<std::string_view> text = cell.GetTextValueView()) {
+				Write(*text);
+				return;
+			}
+			const CellInterface::Value value = cell.GetValue();
+			if (std::holds_alternative<double>(value)) {
+				WriteNumber(std::get<double>(value));
+			}
+			else if (std::holds_alternative<FormulaError>(value)) {
+				Write(std::get<FormulaError>(value).ToString());
+			}
+			else {
+				Write(std::get<std::string>(value));
+			}
+		}
+
+		void WriteText(const Cell& cell) {
+			if (const std::optional<std::string_view> text = cell.GetTextView()) {
+				Write(*text);
+			}
+			else {
+				Write(cell.GetText());
+			}
+		}
+
+		// Забирает накопленный текст (только без потока)
+		std::string Take() {
+			buffer_.resize(size_);
+			size_ = 0;
+			return std::move(buffer_);
 		}
-		auto it = cells_.find(Position{ row, c });
-		if (it != cells_.end() && it->second) {
-			print_cell(it->second.get(), output);
+
+	private:
+		// Освобождает место под size символов: сбрасывает блок в поток
+		// либо, без потока, увеличивает блок
+		void MakeRoom(size_t size) {
+			if (output_) {
+				Flush();
+			}
+			else {
+				buffer_.resize(std::max(buffer_.size() * 2, size_ + size));
+			}
+		}
+
+		void Flush() {
+			if (output_) {
+				output_->write(buffer_.data(), static_cast<std::streamsize>(size_));
+				size_ = 0;
+			}
 		}
+
+	private:
+		static constexpr size_t CAPACITY = size_t{ 1 } << 16;
+		static constexpr size_t NUMBER_SIZE = 32;  // запись %g любого double
+
+		std::ostream* output_;
+		std::string buffer_;
+		size_t size_ = 0;
+	};
+
+	/*
+	 * Вывод прямо в поток через operator<<: учитывает любые настройки
+	 * форматирования потока
+	 */
+	class StreamSink {
+	public:
+		explicit StreamSink(std::ostream& output)
+			: output_(output) {
+		}
+
+		void WriteChars(char c, int count) {
+			for (; count > 0; --count) {
+				output_ << c;
+			}
+		}
+
+		void WriteValue(const Cell& cell) {
+			cell.PrintValue(output_);
+		}
+
+		void WriteText(const Cell& cell) {
+			output_ << cell.GetText();
+		}
+
+	private:
+		std::ostream& output_;
+	};
+
+}  // namespace
+
+template <typename PrintCell>
+void Sheet::PrintArea(std::ostream& output, PrintCell print_cell) const {
+	if (HasDefaultFormat(output)) {
+		BufferedSink sink(&output);
+		PrintRows(sink, print_cell, 0, print_size_.rows);
+	}
+	else {
+		StreamSink sink(output);
+		PrintRows(sink, print_cell, 0, print_size_.rows);
 	}
-	output << '\n';
 }
 
-void Sheet::UpdatePrintSize() {
-	int max_row = 0;
-	int max_col = 0;
-	bool found = false;
-
-	for (const auto& [pos, cell_ptr] : cells_) {
-		if (cell_ptr) {
-			max_row = std::max(max_row, pos.row + 1);
-			max_col = std::max(max_col, pos.col + 1);
-			found = true;
+template <typename Sink, typename PrintCell>
+void Sheet::PrintRows(Sink& sink, PrintCell print_cell, int begin_row, int end_row) const {
+	if (begin_row >= end_row || print_size_.cols == 0) {
+		return;
+	}
+	// Позиция вывода: строка и столбец, до которого она дописана
+	int row = begin_row;
+	int col = 0;
+	auto finish_rows = [&](int end_row) {
+		for (; row < end_row; ++row, col = 0) {
+			sink.WriteChars('\t', print_size_.cols - 1 - col);
+			sink.WriteChars('\n', 1);
 		}
+	};
+	cells_->ForEachInRange(CellRange{ Position{ begin_row, 0 }, Position{ end_row - 1, print_size_.cols - 1 } },
+		[&](Position pos, const Cell& cell) {
+			finish_rows(pos.row);
+			sink.WriteChars('\t', pos.col - col);
+			col = pos.col;
+			print_cell(sink, cell);
+		});
+	finish_rows(end_row);
+}
+
+void Sheet::PrintValuesParallel(std::ostream& output) {
+	Recalculate();
+	auto print_value = [](auto& sink, const Cell& cell) {
+		sink.WriteValue(cell);
+	};
+	if (!recalc_pool_ || !HasDefaultFormat(output)) {
+		PrintArea(output, print_value);
+		return;
 	}
 
-	if (found) {
-		print_size_.rows = max_row;
-		print_size_.cols = max_col;
+	// Блоки строк примерно равного объёма: пустая строка тоже печатается
+	// (табуляции и перевод строки), поэтому считается как одна ячейка
+	constexpr int BLOCK_CELLS = 16384;
+	std::vector<int> bounds{ 0 };
+	for (int row = 0, cells = 0; row < print_size_.rows; ++row) {
+		cells += row_counts_[row] + 1;
+		if (cells >= BLOCK_CELLS || row + 1 == print_size_.rows) {
+			bounds.push_back(row + 1);
+			cells = 0;
+		}
 	}
-	else {
-		print_size_ = Size{};
+	const size_t block_count = bounds.size() - 1;
+
+	// Блоки обрабатываются волнами: волна форматируется параллельно
+	// и выводится целиком, пока следующая ещё не начата
+	const size_t wave_size = recalc_pool_->GetThreadCount() * 4;
+	std::vector<std::string> texts(std::min(block_count, wave_size));
+	std::vector<std::exception_ptr> errors(texts.size());
+	for (size_t wave = 0; wave < block_count; wave += wave_size) {
+		const size_t count = std::min(wave_size, block_count - wave);
+		recalc_pool_->ParallelFor(count, [&](size_t i) {
+			try {
+				BufferedSink sink;
+				PrintRows(sink, print_value, bounds[wave + i], bounds[wave + i + 1]);
+				texts[i] = sink.Take();
+			}
+			catch (...) {
+				errors[i] = std::current_exception();
+			}
+			});
+		for (size_t i = 0; i < count; ++i) {
+			if (errors[i]) {
+				std::rethrow_exception(errors[i]);
+			}
+			output.write(texts[i].data(), static_cast<std::streamsize>(texts[i].size()));
+		}
 	}
 }
 
-void Sheet::ShrinkPrintSize() {
-	// Просто вызываем UpdatePrintSize(), так как область может уменьшиться
-	// после удаления ячейки.
-	UpdatePrintSize();
+void Sheet::AddToPrintArea(Position pos) {
+	++row_counts_[pos.row];
+	++col_counts_[pos.col];
+	print_size_.rows = std::max(print_size_.rows, pos.row + 1);
+	print_size_.cols = std::max(print_size_.cols, pos.col + 1);
+}
+
+void Sheet::RemoveFromPrintArea(Position pos) {
+	--row_counts_[pos.row];
+	--col_counts_[pos.col];
+
+	// Граница сдвигается только если опустела последняя строка/столбец
+	while (print_size_.rows > 0 && row_counts_[print_size_.rows - 1] == 0) {
+		--print_size_.rows;
+	}
+	while (print_size_.cols > 0 && col_counts_[print_size_.cols - 1] == 0) {
+		--print_size_.cols;
+	}
 }
 
 void Sheet::EnsurePositionValid(Position pos) const {
@@ -176,55 +599,337 @@ void Sheet::EnsurePositionValid(Position pos) const {
 }
 
 Cell* Sheet::GetOrCreateCell(Position pos) {
-	auto& cell_ptr = cells_[pos];
-	if (!cell_ptr) {
-		cell_ptr = std::make_unique<Cell>(*this);
+	if (Cell* cell = cells_->Find(pos)) {
+		return cell;
 	}
-	return cell_ptr.get();
+	// Ячейка-формула ещё ни с кем не связана: ставим её после всех,
+	// тогда её будущие входы заведомо окажутся раньше. Но если от позиции
+	// через диапазон уже зависят формулы, ячейка — их вход: ставим её перед всеми
+	Cell* cell = cells_->Emplace(pos);
+	cell->SetOrder(HasRangeDependents(pos) ? --min_order_ : ++max_order_);
+	return cell;
 }
 
 inline bool Sheet::IsFormula(std::string text) {
 	return text.size() > 1 && text[0] == FORMULA_SIGN;
 }
 
-void Sheet::CheckSelfReference(const std::vector<Position>& referenced_cells, Position cell_pos) {
-	if (std::find(referenced_cells.begin(), referenced_cells.end(), cell_pos) != referenced_cells.end()) {
+void Sheet::CheckSelfReference(const std::vector<Position>& referenced_cells,
+	const std::vector<CellRange>& ranges, Position cell_pos) {
+	if (std::find(referenced_cells.begin(), referenced_cells.end(), cell_pos) != referenced_cells.end()
+		|| std::any_of(ranges.begin(), ranges.end(), [cell_pos](CellRange range) {
+			return range.Contains(cell_pos);
+			})) {
 		throw CircularDependencyException("Cyclic dependency: cell references itself");
 	}
 }
 
-void Sheet::CheckCircularDependency(const std::vector<Position>& refs, Position target_pos) {
+void Sheet::CheckCircularDependency(const std::vector<Position>& refs,
+	const std::vector<CellRange>& ranges, Position target_pos) {
+	if (!target_pos.IsValid()) {
+		return;
+	}
+	Cell* target = cells_->Find(target_pos);
+	bool created = false;
+	if (!target) {
+		if (!HasRangeDependents(target_pos)) {
+			// Новая ячейка встанет в конец порядка и ни от кого не зависит
+			return;
+		}
+		// От позиции через диапазон уже зависят формулы: заводим пустую
+		// ячейку перед всеми, как их вход, и проверяем её как существующую
+		target = cells_->Emplace(target_pos);
+		target->SetOrder(--min_order_);
+		created = true;
+	}
+
+	bool has_cycle = false;
+	if (!target->HasDependents() && !HasRangeDependents(target_pos)) {
+		// От ячейки никто не зависит: цикла нет, переносим её в конец порядка
+		target->SetOrder(++max_order_);
+	}
+	else {
+		// Ссылки и ячейки диапазонов, которые стоят в порядке позже target, нарушат его
+		std::vector<Cell*> sources;
+		auto add_source = [target, &sources](Position, Cell& ref) {
+			if (ref.GetOrder() > target->GetOrder()) {
+				sources.push_back(&ref);
+			}
+		};
+		for (const auto& ref_pos : refs) {
+			if (!ref_pos.IsValid()) {
+				continue;  // некорректную ссылку отклонит EnsureCellsExist
+			}
+			if (Cell* ref = cells_->Find(ref_pos)) {
+				add_source(ref_pos, *ref);
+			}
+		}
+		for (CellRange range : ranges) {
+			cells_->ForEachInRange(range, add_source);
+		}
+		// Ячейка может попасть и в ссылки, и в диапазоны
+		std::sort(sources.begin(), sources.end());
+		sources.erase(std::unique(sources.begin(), sources.end()), sources.end());
+		has_cycle = !sources.empty() && !RestoreOrder(sources, target);
+	}
+
+	assert(has_cycle == HasPathByDfs(refs, ranges, target_pos) && "Topological order diverged from DFS");
+	if (has_cycle) {
+		if (created) {
+			cells_->Erase(target_pos);
+		}
+		throw CircularDependencyException("Cyclic dependency detected");
+	}
+}
+
+bool Sheet::RestoreOrder(const std::vector<Cell*>& sources, Cell* target) {
+	const int lower = target->GetOrder();
+	int upper = lower;
+	std::unordered_set<const Cell*> visited{ target };
+	for (const Cell* source : sources) {
+		upper = std::max(upper, source->GetOrder());
+		visited.insert(source);
+	}
+
+	// Прямой поиск: всё, что зависит от target и стоит раньше последней из
+	// sources. Если среди зависимых встретилась одна из sources — цикл
+	std::vector<Cell*> forward;
+	std::vector<Cell*> stack{ target };
+	bool has_cycle = false;
+	while (!stack.empty() && !has_cycle) {
+		Cell* cell = stack.back();
+		stack.pop_back();
+		forward.push_back(cell);
+		ForEachDependent(cell, [&](Cell* dependent) {
+			if (has_cycle || dependent->GetOrder() > upper) {
+				return;
+			}
+			if (!visited.insert(dependent).second) {
+				has_cycle = std::find(sources.begin(), sources.end(), dependent) != sources.end();
+				return;
+			}
+			stack.push_back(dependent);
+			});
+	}
+	if (has_cycle) {
+		return false;
+	}
+
+	// Обратный поиск: всё, от чего зависят sources и что стоит позже target
+	std::vector<Cell*> backward;
+	stack = sources;
+	while (!stack.empty()) {
+		Cell* cell = stack.back();
+		stack.pop_back();
+		backward.push_back(cell);
+		ForEachInput(cell, [&](Cell* input) {
+			if (input->GetOrder() > lower && visited.insert(input).second) {
+				stack.push_back(input);
+			}
+			});
+	}
+
+	// Освободившиеся номера раздаём так: сначала обратное множество,
+	// затем прямое, внутри каждого — в прежнем относительном порядке
+	auto by_order = [](const Cell* lhs, const Cell* rhs) {
+		return lhs->GetOrder() < rhs->GetOrder();
+	};
+	std::sort(backward.begin(), backward.end(), by_order);
+	std::sort(forward.begin(), forward.end(), by_order);
+
+	std::vector<int> orders;
+	orders.reserve(backward.size() + forward.size());
+	for (const Cell* cell : backward) {
+		orders.push_back(cell->GetOrder());
+	}
+	for (const Cell* cell : forward) {
+		orders.push_back(cell->GetOrder());
+	}
+	std::sort(orders.begin(), orders.end());
+
+	size_t next = 0;
+	for (Cell* cell : backward) {
+		cell->SetOrder(orders[next++]);
+	}
+	for (Cell* cell : forward) {
+		cell->SetOrder(orders[next++]);
+	}
+	return true;
+}
+
+bool Sheet::HasPathByDfs(const std::vector<Position>& refs,
+	const std::vector<CellRange>& ranges, Position target_pos) const {
 	std::unordered_set<const Cell*> visited;
+	std::vector<const Cell*> stack;
+	for (const auto& ref_pos : refs) {
+		if (ref_pos.IsValid()) {
+			stack.push_back(cells_->Find(ref_pos));
+		}
+	}
+	for (CellRange range : ranges) {
+		cells_->ForEachInRange(range, [&stack](Position, const Cell& cell) {
+			stack.push_back(&cell);
+			});
+	}
+
+	// Ищем target среди ячеек, от которых зависят ref'ы
+	while (!stack.empty()) {
+		const Cell* cell = stack.back();
+		stack.pop_back();
+		if (!cell || !visited.insert(cell).second) {
+			continue;
+		}
+		if (cell->GetPosition() == target_pos) {
+			return true;
+		}
+		ForEachInput(cell, [&stack](const Cell* input) {
+			stack.push_back(input);
+			});
+	}
+	return false;
+}
 
-	// Рекурсивная лямбда для DFS
-	std::function<bool(const Cell*)> has_cycle = [&](const Cell* cell) -> bool {
-		if (visited.find(cell) != visited.end()) {
-			return true; // цикл найден
+void Sheet::ForEachInput(const Cell* cell, const std::function<void(Cell*)>& visit) const {
+	for (Cell* input : cell->GetInputs()) {
+		if (input) {
+			visit(input);
 		}
-		visited.insert(cell);
+	}
+	for (CellRange range : cell->GetRanges()) {
+		cells_->ForEachInRange(range, [&visit](Position, Cell& input) {
+			visit(&input);
+			});
+	}
+}
 
-		for (const auto& dep_pos : cell->GetReferencedCells()) {
-			if (dep_pos == target_pos) {
-				return true; // достигли целевой ячейки → цикл
+void Sheet::ForEachDependent(const Cell* cell, const std::function<void(Cell*)>& visit) const {
+	for (Cell* dependent : cell->GetDependentsCells()) {
+		visit(dependent);
+	}
+	range_dependents_.ForEachContaining(cell->GetPosition(), visit);
+}
+
+std::vector<Position> Sheet::CheckBatchCycles(const std::vector<PendingCell>& pending) const {
+	// Входы ячейки в итоговом графе: для ячеек пакета — новые ссылки
+	// и диапазоны, для остальных — текущие связи формулы. В диапазоны
+	// попадают и существующие ячейки, и ячейки, которые создаст пакет
+	enum class Mark : char { NotVisited, InProgress, Done };
+	struct Node {
+		const PendingCell* update = nullptr;
+		Mark mark = Mark::NotVisited;
+	};
+	struct Frame {
+		Position pos;
+		const std::vector<Position>* refs = nullptr;
+		const std::vector<Cell*>* inputs = nullptr;
+		std::vector<Position> range_inputs;
+		size_t next = 0;
+	};
+
+	// Одна карта на пакет и отметки обхода: по одному поиску на ребро
+	std::unordered_map<Position, Node, PositionHash> nodes;
+	nodes.reserve(pending.size());
+	for (const PendingCell& update : pending) {
+		nodes[update.pos].update = &update;
+	}
+	std::vector<Frame> stack;
+	std::vector<Position> order;
+	order.reserve(pending.size());
+
+	// Позиции пакета по возрастанию — для поиска внутри диапазонов.
+	// Строятся при первом диапазоне
+	std::vector<Position> batch_positions;
+	auto collect_range_inputs = [&](const std::vector<CellRange>& ranges, std::vector<Position>& range_inputs) {
+		if (batch_positions.empty()) {
+			for (const PendingCell& update : pending) {
+				batch_positions.push_back(update.pos);
 			}
-			if (const auto* dep_cell = dynamic_cast<const Cell*>(GetCell(dep_pos))) {
-				if (has_cycle(dep_cell)) {
-					return true;
+			std::sort(batch_positions.begin(), batch_positions.end());
+		}
+		for (CellRange range : ranges) {
+			cells_->ForEachInRange(range, [&range_inputs](Position pos, const Cell&) {
+				range_inputs.push_back(pos);
+				});
+			for (int row = range.first.row; row <= range.last.row; ++row) {
+				auto it = std::lower_bound(batch_positions.begin(), batch_positions.end(),
+					Position{ row, range.first.col });
+				for (; it != batch_positions.end() && it->row == row && it->col <= range.last.col; ++it) {
+					range_inputs.push_back(*it);
 				}
 			}
 		}
+	};
+
+	auto push = [&](Position pos, Node& node) {
+		node.mark = Mark::InProgress;
+		Frame frame{ pos, nullptr, nullptr, {}, 0 };
+		const std::vector<CellRange>* ranges = nullptr;
+		if (node.update) {
+			frame.refs = &node.update->refs;
+			ranges = &node.update->ranges;
+		}
+		else if (const Cell* cell = cells_->Find(pos)) {
+			frame.inputs = &cell->GetInputs();
+			ranges = &cell->GetRanges();
+		}
+		if (ranges && !ranges->empty()) {
+			collect_range_inputs(*ranges, frame.range_inputs);
+		}
+		stack.push_back(std::move(frame));
+	};
 
-		visited.erase(cell);
-		return false;
-		};
+	for (const PendingCell& update : pending) {
+		Node& root = nodes[update.pos];
+		if ((update.refs.empty() && update.ranges.empty()) || root.mark != Mark::NotVisited) {
+			continue;
+		}
+		push(update.pos, root);
+		while (!stack.empty()) {
+			Frame& frame = stack.back();
+			const size_t direct = frame.refs ? frame.refs->size() : frame.inputs ? frame.inputs->size() : 0;
+			Position next = Position::NONE;
+			if (frame.next < direct) {
+				if (frame.refs) {
+					next = (*frame.refs)[frame.next];
+				}
+				else if (const Cell* input = (*frame.inputs)[frame.next]) {
+					next = input->GetPosition();
+				}
+				++frame.next;
+			}
+			else if (frame.next < direct + frame.range_inputs.size()) {
+				next = frame.range_inputs[frame.next - direct];
+				++frame.next;
+			}
+			else {
+				nodes[frame.pos].mark = Mark::Done;
+				order.push_back(frame.pos);
+				stack.pop_back();
+				continue;
+			}
+			if (!next.IsValid()) {
+				continue;
+			}
 
-	// Запускаем DFS из каждой ячейки, на которую ссылается формула
-	for (const auto& ref_pos : refs) {
-		const Cell* start_cell = dynamic_cast<const Cell*>(GetCell(ref_pos));
-		if (start_cell && has_cycle(start_cell)) {
-			throw CircularDependencyException("Cyclic dependency detected");
+			Node& node = nodes[next];
+			if (node.mark == Mark::NotVisited) {
+				push(next, node);
+			}
+			else if (node.mark == Mark::InProgress) {
+				// Цикл — ячейки стека от next до вершины
+				std::string message = "Cyclic dependency detected:";
+				auto it = std::find_if(stack.begin(), stack.end(), [next](const Frame& f) {
+					return f.pos == next;
+					});
+				for (; it != stack.end(); ++it) {
+					message += " " + it->pos.ToString() + " ->";
+				}
+				message += " " + next.ToString();
+				throw CircularDependencyException(message);
+			}
 		}
 	}
+	return order;
 }
 
 void Sheet::EnsureCellsExist(const std::vector<Position>& positions) {
@@ -232,8 +937,9 @@ void Sheet::EnsureCellsExist(const std::vector<Position>& positions) {
 		if (!pos.IsValid()) {
 			throw FormulaException("Invalid cell position in formula: " + pos.ToString());
 		}
-		if (cells_.find(pos) == cells_.end()) {
-			cells_[pos] = std::make_unique<Cell>(*this);
+		if (!cells_->Find(pos)) {
+			// Новый вход ни от чего не зависит: ставим его перед всеми
+			cells_->Emplace(pos)->SetOrder(--min_order_);
 		}
 	}
 }
@@ -241,9 +947,11 @@ void Sheet::EnsureCellsExist(const std::vector<Position>& positions) {
 void Sheet::UpdateDependencies(Cell* cell,
 	const std::vector<Position>& old_refs,
 	const std::vector<Position>& new_refs) {
+	const Position cell_pos = cell->GetPosition();
+
 	// Удаляем эту ячейку из dependents_ старых зависимостей
 	for (const auto& ref_pos : old_refs) {
-		if (ref_pos == GetPosition(cell)) continue; // на всякий случай исключаем самоссылку
+		if (ref_pos == cell_pos) continue; // на всякий случай исключаем самоссылку
 		if (auto* dep_cell = dynamic_cast<Cell*>(GetCell(ref_pos))) {
 			dep_cell->RemoveDependentCell(cell);
 		}
@@ -251,13 +959,28 @@ void Sheet::UpdateDependencies(Cell* cell,
 
 	// Добавляем эту ячейку в dependents_ новых зависимостей
 	for (const auto& ref_pos : new_refs) {
-		if (ref_pos == GetPosition(cell)) continue;
+		if (ref_pos == cell_pos) continue;
 		auto* dep_cell = dynamic_cast<Cell*>(GetCell(ref_pos));
 		assert(dep_cell && "Dependency cell must exist after EnsureCellsExist");
 		dep_cell->AddDependentCell(cell);
 	}
 }
 
+void Sheet::UpdateRangeDependencies(Cell* cell,
+	const std::vector<CellRange>& old_ranges,
+	const std::vector<CellRange>& new_ranges) {
+	for (CellRange range : old_ranges) {
+		range_dependents_.Remove(range, cell);
+	}
+	for (CellRange range : new_ranges) {
+		range_dependents_.Add(range, cell);
+	}
+}
+
 std::unique_ptr<SheetInterface> CreateSheet() {
 	return std::make_unique<Sheet>();
+}
+
+std::unique_ptr<SheetInterface> CreateSheet(StorageType storage_type) {
+	return std::make_unique<Sheet>(storage_type);
 }
\ No newline at end of file
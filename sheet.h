@@ -2,11 +2,15 @@
 
 #include "cell.h"
 #include "common.h"
+#include "range_index.h"
+#include "storage.h"
+#include "text_pool.h"
+#include "thread_pool.h"
 
 #include <memory>
 #include <ostream>
 #include <string>
-#include <unordered_map>
+#include <utility>
 #include <vector>
 #include <functional>
 
@@ -17,7 +21,8 @@
  */
 class Sheet : public SheetInterface {
 public:
-	Sheet() = default;
+	// Создаёт пустой лист с хранилищем ячеек указанного типа
+	explicit Sheet(StorageType storage_type = StorageType::Tiled);
 	~Sheet() override = default;
 
 	// Устанавливает содержимое ячейки по указанной позиции.
@@ -27,8 +32,22 @@ public:
 	// Обновляет размер печатной области.
 	// При необходимости создаёт зависимые ячейки
 	// Инвалидирует кэш ячейки и зависимых ячеек
+	// Формула, которая отличается от уже установленной только сдвигом
+	// ссылок, не разбирается заново (см. FormulaTemplates)
 	void SetCell(Position pos, std::string text) override;
 
+	// Новое содержимое ячейки для пакетной записи
+	using CellUpdate = std::pair<Position, std::string>;
+
+	// Устанавливает содержимое многих ячеек одной транзакцией.
+	// При повторе позиции действует последняя запись.
+	// Формулы разбираются параллельно на пуле пересчёта (если он задан),
+	// циклы ищутся одним обходом для итогового состояния листа,
+	// связи перестраиваются, а кэши сбрасываются один раз на пакет.
+	// При любой ошибке (позиция, синтаксис, цикл) лист не меняется;
+	// CircularDependencyException перечисляет ячейки найденного цикла.
+	void SetCells(std::vector<CellUpdate> updates);
+
 	// Возвращает константный указатель на ячейку по позиции.
 	// Возвращает nullptr, если ячейка пуста или позиция вне диапазона.
 	const CellInterface* GetCell(Position pos) const override;
@@ -37,11 +56,13 @@ public:
 	CellInterface* GetCell(Position pos) override;
 
 	// Очищает содержимое ячейки (устанавливает в пустое состояние).
-	// Если ячейка существовала, освобождает её ресурсы.
+	// Ячейка отвязывается от ячеек, на которые ссылалась. Если от неё никто
+	// не зависит, она удаляется; иначе остаётся пустой, чтобы указатели
+	// зависимых формул оставались действительными.
 	// Корректирует размер печатной области, если нужно.
 	void ClearCell(Position pos) override;
 
-	// Возвращает позицию ячейки
+	// Возвращает позицию ячейки. O(1)
 	Position GetPosition(const Cell* cell) const;
 
 	// Возвращает размер прямоугольной области, содержащей все непустые ячейки.
@@ -61,26 +82,69 @@ public:
 	// Пустые ячейки — пустые строки. Столбцы разделены табуляцией.
 	void PrintTexts(std::ostream& output) const override;
 
-	// Хэш-функция для Position — требуется для использования в unordered_map.
-	struct PositionHash {
-		size_t operator()(const Position& pos) const {
-			// Комбинируем row и col через битовый сдвиг.
-			return static_cast<size_t>(pos.row) ^
-				(static_cast<size_t>(pos.col) << 16);
-		}
-	};
+	// Печатает значения как PrintValues, предварительно вычислив все
+	// формулы (Recalculate): после пересчёта чтение значений не меняет
+	// кэши формул, и ячейки можно форматировать из разных потоков.
+	// Печатная область делится на блоки строк, блоки форматируются
+	// в отдельные буферы на пуле пересчёта и пишутся в output по порядку.
+	// В памяти одновременно держится не больше нескольких блоков на поток.
+	// Без пула или при изменённом форматировании потока печатает
+	// в текущем потоке
+	void PrintValuesParallel(std::ostream& output);
+
+	// Задаёт число потоков пересчёта формул, включая вызывающий.
+	// 0 или 1 — пересчёт в текущем потоке (по умолчанию)
+	void SetRecalculationThreads(size_t thread_count);
+
+	// Возвращает пул пересчёта либо nullptr в однопоточном режиме
+	ThreadPool* GetRecalculationPool() const;
+
+	// Включает интернирование текстов: ячейки с одинаковым текстом,
+	// установленные после этого, делят одну копию (см. TextPool).
+	// По умолчанию выключено; уже установленные ячейки не меняются
+	void SetTextInterning(bool enabled);
+
+	// Возвращает таблицу текстов либо nullptr, если интернирование выключено
+	TextPool* GetTextPool();
+
+	// Число различных текстов в таблице листа
+	size_t GetInternedTextCount() const;
+
+	// Вычисляет все формулы листа, кэш которых сброшен.
+	// В многопоточном режиме независимые формулы вычисляются параллельно.
+	// Без вызова формулы вычисляются лениво, при чтении значения
+	void Recalculate();
+
+	// Обходит существующие ячейки диапазона по строкам, слева направо
+	void ForEachCellInRange(CellRange range, const CellStorage::Visitor& visit) const;
+
+	// Вызывает visit для каждой формулы, диапазон которой содержит pos
+	void ForEachRangeDependent(Position pos, const RangeIndex::Visitor& visit) const;
+
+	// Проверяет, зависит ли от позиции какая-нибудь формула через диапазон
+	bool HasRangeDependents(Position pos) const;
 
 private:
-	// Лямбда для печати
-	using CellPrinter = std::function<void(const Cell*, std::ostream&)>;
+	// Запись пакета после разбора
+	struct PendingCell {
+		Position pos;
+		std::string text;
+		std::unique_ptr<FormulaInterface> formula;
+		std::vector<Position> refs;
+		std::vector<CellRange> ranges;
+		bool was_empty = true;
+	};
 
-	// Обновляет размер печатной области (print_size_) на основе текущих ячеек.
-	// Проходит по всем занятым позициям, определяет максимальные индексы.
-	void UpdatePrintSize();
+	// Учитывает ячейку, ставшую непустой: увеличивает счётчики её строки
+	// и столбца и при необходимости расширяет печатную область. O(1).
+	void AddToPrintArea(Position pos);
 
-	// Аналогично UpdatePrintSize, но вызывается после очистки ячейки,
-	// чтобы уменьшить размер области, если последние данные были удалены.
-	void ShrinkPrintSize();
+	// Учитывает ячейку, ставшую пустой. Если опустела граничная строка или
+	// столбец, область сжимается до ближайшей занятой строки/столбца.
+	// Сжатие стоит числа строк/столбцов, на которое сдвинулась граница;
+	// граница опускается лишь туда, куда её раньше подняли, поэтому
+	// суммарно сжатия не дороже суммарного роста границы.
+	void RemoveFromPrintArea(Position pos);
 
 	// Проверяет позицию; бросает InvalidPositionException, если некорректна
 	void EnsurePositionValid(Position pos) const;
@@ -91,11 +155,44 @@ private:
 	// Проверяет строку на предмет, не формула ли это
 	inline bool IsFormula(std::string text);
 
-	// Проверяет, не ссылается ли формула на саму себя
-	void CheckSelfReference(const std::vector<Position>& referenced_cells, Position cell_pos);
+	// Проверяет, не ссылается ли формула на саму себя, в том числе
+	// через диапазон
+	void CheckSelfReference(const std::vector<Position>& referenced_cells,
+		const std::vector<CellRange>& ranges, Position cell_pos);
+
+	// Проверяет, не возникнет ли циклическая зависимость при установке
+	// формулы со ссылками refs и диапазонами ranges в ячейку target_pos.
+	// Бросает CircularDependencyException. Попутно подготавливает
+	// топологический порядок ячеек к новым связям; затрагивается только
+	// участок порядка между target_pos и ссылкой, а не весь граф
+	void CheckCircularDependency(const std::vector<Position>& refs,
+		const std::vector<CellRange>& ranges, Position target_pos);
 
-	// Проверяет, не возникнет ли циклическая зависимость при установке формулы
-	void CheckCircularDependency(const std::vector<Position>& refs, Position target_pos);
+	// Восстанавливает порядок для будущих связей source -> target, когда все
+	// sources стоят позже target (алгоритм Пирса — Келли). Поиск ограничен
+	// ячейками с номерами между номерами target и последней из sources.
+	// Возвращает false, если одна из sources зависит от target, то есть
+	// связи образуют цикл; порядок при этом не меняется
+	bool RestoreOrder(const std::vector<Cell*>& sources, Cell* target);
+
+	// Эталонная проверка обходом в глубину: достижима ли target_pos из refs
+	// по ссылкам формул. O(размер графа); используется в отладочной сборке
+	// для сверки с RestoreOrder
+	bool HasPathByDfs(const std::vector<Position>& refs,
+		const std::vector<CellRange>& ranges, Position target_pos) const;
+
+	// Обходит ячейки, от которых зависит формула cell: привязанные входы
+	// и существующие ячейки её диапазонов
+	void ForEachInput(const Cell* cell, const std::function<void(Cell*)>& visit) const;
+
+	// Обходит ячейки, которые зависят от cell, в том числе через диапазоны
+	void ForEachDependent(const Cell* cell, const std::function<void(Cell*)>& visit) const;
+
+	// Ищет цикл в графе, который получится после записи пакета, обходом
+	// в глубину от формул пакета. Бросает CircularDependencyException
+	// с перечнем ячеек цикла. Возвращает пройденные позиции
+	// в топологическом порядке: входы раньше зависимых
+	std::vector<Position> CheckBatchCycles(const std::vector<PendingCell>& pending) const;
 
 	// Создаёт пустые ячейки для указанных позиций, если они ещё не существуют
 	void EnsureCellsExist(const std::vector<Position>& positions);
@@ -105,16 +202,56 @@ private:
 		const std::vector<Position>& old_refs,
 		const std::vector<Position>& new_refs);
 
-	// Печатает значения или текстовое содержимое всех ячеек строки таблицы.
-	void PrintRow(const int row, std::ostream& output, CellPrinter print_cell) const;
+	// То же для диапазонов: одна связь на диапазон формулы
+	void UpdateRangeDependencies(Cell* cell,
+		const std::vector<CellRange>& old_ranges,
+		const std::vector<CellRange>& new_ranges);
+
+	// Печатает печатную область в output: print_cell(sink, cell) для каждой
+	// существующей ячейки, табуляции между столбцами, перевод строки после
+	// каждой строки. Если форматирование потока не менялось, вывод идёт
+	// через буфер (числа — std::to_chars), иначе — прямо в поток
+	template <typename PrintCell>
+	void PrintArea(std::ostream& output, PrintCell print_cell) const;
+
+	// То же для строк [begin_row, end_row) печатной области в заданный
+	// приёмник. Обходятся только существующие ячейки, по строкам
+	// (CellStorage::ForEachInRange)
+	template <typename Sink, typename PrintCell>
+	void PrintRows(Sink& sink, PrintCell print_cell, int begin_row, int end_row) const;
 
 private:
-	// Хранение ячеек: разреженная таблица на основе хэш-карты.
-	// Ключ — позиция (row, col), значение — уникальный указатель на Cell.
-	// Эффективно по памяти при разреженных данных.
-	std::unordered_map<Position, std::unique_ptr<Cell>, PositionHash> cells_;
+	// Общие тексты ячеек. Объявлена раньше хранилища: ячейки ссылаются
+	// на её записи и должны быть удалены раньше неё
+	TextPool text_pool_;
+	bool intern_texts_ = false;
+
+	// Хранение ячеек: блочное (по умолчанию) или на основе хэш-карты.
+	// Адреса ячеек стабильны до их удаления.
+	std::unique_ptr<CellStorage> cells_;
 
 	// Размер прямоугольника, содержащего все непустые ячейки.
 	// Используется для эффективного вывода таблицы (PrintValues/PrintTexts).
 	Size print_size_;
+
+	// Число непустых ячеек в каждой строке и в каждом столбце
+	std::vector<int> row_counts_;
+	std::vector<int> col_counts_;
+
+	// Границы топологического порядка (см. Cell::GetOrder): новые входы
+	// получают номер меньше всех, новые формулы — больше всех
+	int min_order_ = 0;
+	int max_order_ = 0;
+
+	// Формулы, зависящие от диапазонов ячеек
+	RangeIndex range_dependents_;
+
+	// Общие шаблоны формул, отличающихся сдвигом ссылок (заполнение вниз)
+	FormulaTemplates formula_templates_;
+
+	// Пул потоков пересчёта; nullptr — однопоточный режим
+	std::unique_ptr<ThreadPool> recalc_pool_;
 };
+
+// Создаёт пустую таблицу с хранилищем ячеек указанного типа.
+std::unique_ptr<SheetInterface> CreateSheet(StorageType storage_type);
@@ -0,0 +1,486 @@
+#include "storage.h"
+
+#include "cell.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <new>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace {
+
+	// Перемешивает биты упакованной позиции (финализатор MurmurHash3):
+	// младшие биты результата зависят и от строки, и от столбца
+	uint64_t MixPosition(uint32_t key) {
+		uint64_t hash = key;
+		hash ^= hash >> 33;
+		hash *= 0xff51afd7ed558ccdULL;
+		hash ^= hash >> 33;
+		hash *= 0xc4ceb9fe1a85ec53ULL;
+		hash ^= hash >> 33;
+		return hash;
+	}
+
+	// Обходит ячейки диапазона хэш-хранилища по строкам. Если позиций
+	// в диапазоне не больше, чем ячеек, проверяет каждую через find;
+	// иначе перебирает все ячейки (for_each_cell) и сортирует попавшие
+	// в диапазон — в разреженном листе так дешевле промахов поиска
+	template <typename Find, typename ForEachCell>
+	void ForEachInHashRange(CellRange range, const CellStorage::Visitor& visit, size_t cell_count,
+		Find find, ForEachCell for_each_cell) {
+		const size_t area = static_cast<size_t>(range.last.row - range.first.row + 1)
+			* static_cast<size_t>(range.last.col - range.first.col + 1);
+		if (area <= cell_count) {
+			for (int row = range.first.row; row <= range.last.row; ++row) {
+				for (int col = range.first.col; col <= range.last.col; ++col) {
+					if (Cell* cell = find(Position{ row, col })) {
+						visit(Position{ row, col }, *cell);
+					}
+				}
+			}
+			return;
+		}
+		// Упакованные позиции упорядочены так же, как позиции (по строкам)
+		std::vector<std::pair<uint32_t, Cell*>> cells;
+		for_each_cell([&](Position pos, Cell* cell) {
+			if (range.Contains(pos)) {
+				cells.emplace_back(pos.Pack(), cell);
+			}
+			});
+		std::sort(cells.begin(), cells.end());
+		for (const auto& [key, cell] : cells) {
+			visit(Position::Unpack(key), *cell);
+		}
+	}
+
+	/*
+	 * Разреженное хранилище на основе хэш-карты.
+	 * Ключ — позиция (row, col), значение — уникальный указатель на Cell.
+	 */
+	class HashCellStorage final : public CellStorage {
+	public:
+		Cell* Find(Position pos) const override {
+			auto it = cells_.find(pos);
+			return it == cells_.end() ? nullptr : it->second.get();
+		}
+
+		Cell* Emplace(Position pos) override {
+			auto& cell_ptr = cells_[pos];
+			if (!cell_ptr) {
+				cell_ptr = std::make_unique<Cell>(pos);
+			}
+			return cell_ptr.get();
+		}
+
+		bool Erase(Position pos) override {
+			return cells_.erase(pos) > 0;
+		}
+
+		void ForEach(const Visitor& visit) const override {
+			for (const auto& [pos, cell_ptr] : cells_) {
+				visit(pos, *cell_ptr);
+			}
+		}
+
+		void ForEachInRange(CellRange range, const Visitor& visit) const override {
+			ForEachInHashRange(range, visit, cells_.size(),
+				[this](Position pos) { return Find(pos); },
+				[this](auto&& visit_cell) {
+					for (const auto& [pos, cell_ptr] : cells_) {
+						visit_cell(pos, cell_ptr.get());
+					}
+				});
+		}
+
+	private:
+		std::unordered_map<Position, std::unique_ptr<Cell>, PositionHash> cells_;
+	};
+
+	/*
+	 * Разреженное хранилище на основе хэш-таблицы с открытой адресацией:
+	 * линейное пробирование по схеме Robin Hood (элемент, ушедший от своего
+	 * слота дальше, вытесняет более близкий), удаление — обратным сдвигом.
+	 * Слот — упакованная позиция и указатель на ячейку, слоты лежат одним
+	 * массивом, поэтому поиск обычно читает одну кэш-линию. Индекс слота —
+	 * младшие биты перемешанной позиции (MixPosition).
+	 * Ячейки выделяются блоками по CHUNK_CELLS, места удалённых ячеек
+	 * используются повторно: аллокаций на ячейку нет, а адреса ячеек
+	 * не меняются при росте таблицы.
+	 */
+	class FlatHashCellStorage final : public CellStorage {
+	private:
+		static constexpr uint32_t EMPTY = UINT32_MAX;
+		static constexpr size_t MIN_CAPACITY = 16;
+		static constexpr size_t CHUNK_CELLS = 1024;
+
+		struct Slot {
+			uint32_t key = EMPTY;   // упакованная позиция (Position::Pack)
+			uint32_t distance = 0;  // расстояние от слота, на который указывает хэш
+			Cell* cell = nullptr;
+		};
+
+		// Память под одну ячейку
+		struct alignas(Cell) CellMemory {
+			std::byte data[sizeof(Cell)];
+		};
+
+	public:
+		FlatHashCellStorage()
+			: slots_(MIN_CAPACITY) {
+		}
+
+		FlatHashCellStorage(const FlatHashCellStorage&) = delete;
+		FlatHashCellStorage& operator=(const FlatHashCellStorage&) = delete;
+
+		~FlatHashCellStorage() override {
+			for (const Slot& slot : slots_) {
+				if (slot.key != EMPTY) {
+					slot.cell->~Cell();
+				}
+			}
+		}
+
+		Cell* Find(Position pos) const override {
+			const size_t index = FindIndex(pos.Pack());
+			return index == slots_.size() ? nullptr : slots_[index].cell;
+		}
+
+		Cell* Emplace(Position pos) override {
+			if (Cell* cell = Find(pos)) {
+				return cell;
+			}
+			// Заполненность не выше 7/8: длина пробирования остаётся короткой
+			if ((size_ + 1) * 8 > slots_.size() * 7) {
+				Rehash(slots_.size() * 2);
+			}
+			Cell* cell = new (AllocateCell()) Cell(pos);
+			Insert(Slot{ pos.Pack(), 0, cell });
+			++size_;
+			return cell;
+		}
+
+		bool Erase(Position pos) override {
+			size_t index = FindIndex(pos.Pack());
+			if (index == slots_.size()) {
+				return false;
+			}
+			Cell* cell = slots_[index].cell;
+			cell->~Cell();
+			free_cells_.push_back(reinterpret_cast<CellMemory*>(cell));
+
+			// Сдвигаем хвост цепочки на освободившееся место: так не нужны
+			// метки удалённых слотов, и поиск остаётся коротким
+			for (size_t next = Next(index); slots_[next].key != EMPTY && slots_[next].distance > 0;
+				index = next, next = Next(next)) {
+				slots_[index] = slots_[next];
+				--slots_[index].distance;
+			}
+			slots_[index] = Slot{};
+			--size_;
+			return true;
+		}
+
+		void ForEach(const Visitor& visit) const override {
+			for (const Slot& slot : slots_) {
+				if (slot.key != EMPTY) {
+					visit(Position::Unpack(slot.key), *slot.cell);
+				}
+			}
+		}
+
+		void ForEachInRange(CellRange range, const Visitor& visit) const override {
+			ForEachInHashRange(range, visit, size_,
+				[this](Position pos) { return Find(pos); },
+				[this](auto&& visit_cell) {
+					for (const Slot& slot : slots_) {
+						if (slot.key != EMPTY) {
+							visit_cell(Position::Unpack(slot.key), slot.cell);
+						}
+					}
+				});
+		}
+
+	private:
+		size_t Home(uint32_t key) const {
+			return static_cast<size_t>(MixPosition(key)) & (slots_.size() - 1);
+		}
+
+		size_t Next(size_t index) const {
+			return (index + 1) & (slots_.size() - 1);
+		}
+
+		// Индекс слота с ключом key либо slots_.size(), если его нет
+		size_t FindIndex(uint32_t key) const {
+			size_t index = Home(key);
+			for (uint32_t distance = 0;; ++distance, index = Next(index)) {
+				const Slot& slot = slots_[index];
+				if (slot.key == key) {
+					return index;
+				}
+				// Ключ стоял бы не дальше от своего слота, чем встреченный
+				if (slot.key == EMPTY || slot.distance < distance) {
+					return slots_.size();
+				}
+			}
+		}
+
+		// Вставляет отсутствующий ключ; свободный слот должен быть
+		void Insert(Slot slot) {
+			for (size_t index = Home(slot.key);; index = Next(index), ++slot.distance) {
+				Slot& current = slots_[index];
+				if (current.key == EMPTY) {
+					current = slot;
+					return;
+				}
+				if (current.distance < slot.distance) {
+					std::swap(current, slot);
+				}
+			}
+		}
+
+		void Rehash(size_t capacity) {
+			std::vector<Slot> old(capacity);
+			old.swap(slots_);
+			for (Slot slot : old) {
+				if (slot.key != EMPTY) {
+					slot.distance = 0;
+					Insert(slot);
+				}
+			}
+		}
+
+		void* AllocateCell() {
+			if (!free_cells_.empty()) {
+				CellMemory* memory = free_cells_.back();
+				free_cells_.pop_back();
+				return memory;
+			}
+			if (chunks_.empty() || chunk_used_ == CHUNK_CELLS) {
+				// Без инициализации: ячейки конструируются по месту
+				chunks_.emplace_back(new CellMemory[CHUNK_CELLS]);
+				chunk_used_ = 0;
+			}
+			return &chunks_.back()[chunk_used_++];
+		}
+
+	private:
+		std::vector<Slot> slots_;  // размер — степень двойки
+		size_t size_ = 0;
+
+		std::vector<std::unique_ptr<CellMemory[]>> chunks_;
+		size_t chunk_used_ = 0;  // занято мест в последнем блоке
+		std::vector<CellMemory*> free_cells_;
+	};
+
+	/*
+	 * Блочное хранилище.
+	 * Лист 16384x16384 разбит на блоки 64x64, которые выделяются по требованию.
+	 * Блоки адресуются двухуровневым каталогом: строка блоков -> блок.
+	 * Ячейки внутри блока лежат по строкам подряд, без отдельных аллокаций,
+	 * поэтому поиск — это индексация массивов, а обход строки — линейный проход.
+	 */
+	class TiledCellStorage final : public CellStorage {
+	private:
+		static constexpr int BLOCK_BITS = 6;
+		static constexpr int BLOCK_SIZE = 1 << BLOCK_BITS;
+		static constexpr int BLOCK_MASK = BLOCK_SIZE - 1;
+		static constexpr int BLOCK_CELLS = BLOCK_SIZE * BLOCK_SIZE;
+		static constexpr int BLOCK_ROWS = Position::MAX_ROWS / BLOCK_SIZE;
+		static constexpr int BLOCK_COLS = Position::MAX_COLS / BLOCK_SIZE;
+
+		static_assert(Position::MAX_ROWS % BLOCK_SIZE == 0);
+		static_assert(Position::MAX_COLS % BLOCK_SIZE == 0);
+
+		/*
+		 * Блок ячеек. Память под ячейки не инициализируется,
+		 * занятые места отмечены в масках строк (бит на столбец).
+		 */
+		class Block {
+		public:
+			Block() {
+				// Пользовательский конструктор: не обнуляем память под ячейки
+				used_.fill(0);
+			}
+
+			Block(const Block&) = delete;
+			Block& operator=(const Block&) = delete;
+
+			~Block() {
+				for (int r = 0; r < BLOCK_SIZE; ++r) {
+					for (int c = 0; used_[r] != 0 && c < BLOCK_SIZE; ++c) {
+						if (IsUsed(r, c)) {
+							Slot(r, c)->~Cell();
+						}
+					}
+				}
+			}
+
+			Cell* Find(int r, int c) const {
+				return IsUsed(r, c) ? Slot(r, c) : nullptr;
+			}
+
+			Cell* Emplace(int r, int c, Position pos) {
+				if (!IsUsed(r, c)) {
+					new (data_ + Offset(r, c)) Cell(pos);
+					used_[r] |= Bit(c);
+					++count_;
+				}
+				return Slot(r, c);
+			}
+
+			bool Erase(int r, int c) {
+				if (!IsUsed(r, c)) {
+					return false;
+				}
+				Slot(r, c)->~Cell();
+				used_[r] &= ~Bit(c);
+				--count_;
+				return true;
+			}
+
+			bool IsEmpty() const {
+				return count_ == 0;
+			}
+
+			// Обходит занятые ячейки строки r блока в столбцах [c_begin, c_end)
+			void ForEachInRow(Position origin, int r, int c_begin, int c_end, const Visitor& visit) const {
+				for (int c = c_begin; used_[r] != 0 && c < c_end; ++c) {
+					if (IsUsed(r, c)) {
+						visit(Position{ origin.row + r, origin.col + c }, *Slot(r, c));
+					}
+				}
+			}
+
+			void ForEach(Position origin, const Visitor& visit) const {
+				for (int r = 0; r < BLOCK_SIZE; ++r) {
+					for (int c = 0; used_[r] != 0 && c < BLOCK_SIZE; ++c) {
+						if (IsUsed(r, c)) {
+							visit(Position{ origin.row + r, origin.col + c }, *Slot(r, c));
+						}
+					}
+				}
+			}
+
+		private:
+			static uint64_t Bit(int c) {
+				return uint64_t{ 1 } << c;
+			}
+
+			static size_t Offset(int r, int c) {
+				return static_cast<size_t>(r * BLOCK_SIZE + c) * sizeof(Cell);
+			}
+
+			bool IsUsed(int r, int c) const {
+				return (used_[r] & Bit(c)) != 0;
+			}
+
+			Cell* Slot(int r, int c) const {
+				return std::launder(reinterpret_cast<Cell*>(data_ + Offset(r, c)));
+			}
+
+		private:
+			alignas(Cell) mutable std::byte data_[sizeof(Cell) * BLOCK_CELLS];
+			std::array<uint64_t, BLOCK_SIZE> used_;
+			int count_ = 0;
+		};
+
+		static_assert(BLOCK_SIZE <= 64, "маска строки блока — 64-битное слово");
+
+		using BlockRow = std::array<std::unique_ptr<Block>, BLOCK_COLS>;
+
+	public:
+		Cell* Find(Position pos) const override {
+			const Block* block = FindBlock(pos);
+			return block ? block->Find(pos.row & BLOCK_MASK, pos.col & BLOCK_MASK) : nullptr;
+		}
+
+		Cell* Emplace(Position pos) override {
+			auto& row = directory_[pos.row >> BLOCK_BITS];
+			if (!row) {
+				row = std::make_unique<BlockRow>();
+			}
+			auto& block = (*row)[pos.col >> BLOCK_BITS];
+			if (!block) {
+				block = std::make_unique<Block>();
+			}
+			return block->Emplace(pos.row & BLOCK_MASK, pos.col & BLOCK_MASK, pos);
+		}
+
+		bool Erase(Position pos) override {
+			auto& row = directory_[pos.row >> BLOCK_BITS];
+			if (!row) {
+				return false;
+			}
+			auto& block = (*row)[pos.col >> BLOCK_BITS];
+			if (!block || !block->Erase(pos.row & BLOCK_MASK, pos.col & BLOCK_MASK)) {
+				return false;
+			}
+			// Опустевший блок освобождаем
+			if (block->IsEmpty()) {
+				block.reset();
+			}
+			return true;
+		}
+
+		void ForEach(const Visitor& visit) const override {
+			for (int br = 0; br < BLOCK_ROWS; ++br) {
+				if (!directory_[br]) {
+					continue;
+				}
+				for (int bc = 0; bc < BLOCK_COLS; ++bc) {
+					if (const auto& block = (*directory_[br])[bc]) {
+						block->ForEach(Position{ br << BLOCK_BITS, bc << BLOCK_BITS }, visit);
+					}
+				}
+			}
+		}
+
+		void ForEachInRange(CellRange range, const Visitor& visit) const override {
+			const int first_block_col = range.first.col >> BLOCK_BITS;
+			const int last_block_col = range.last.col >> BLOCK_BITS;
+			for (int row = range.first.row; row <= range.last.row; ++row) {
+				const auto& block_row = directory_[row >> BLOCK_BITS];
+				if (!block_row) {
+					// Строка блоков пуста целиком: переходим к следующей
+					row |= BLOCK_MASK;
+					continue;
+				}
+				for (int bc = first_block_col; bc <= last_block_col; ++bc) {
+					const auto& block = (*block_row)[bc];
+					if (!block) {
+						continue;
+					}
+					const int origin_col = bc << BLOCK_BITS;
+					block->ForEachInRow(Position{ row & ~BLOCK_MASK, origin_col }, row & BLOCK_MASK,
+						std::max(range.first.col, origin_col) - origin_col,
+						std::min(range.last.col, origin_col + BLOCK_MASK) - origin_col + 1, visit);
+				}
+			}
+		}
+
+	private:
+		const Block* FindBlock(Position pos) const {
+			const auto& row = directory_[pos.row >> BLOCK_BITS];
+			return row ? (*row)[pos.col >> BLOCK_BITS].get() : nullptr;
+		}
+
+	private:
+		std::array<std::unique_ptr<BlockRow>, BLOCK_ROWS> directory_;
+	};
+
+}  // namespace
+
+std::unique_ptr<CellStorage> CreateCellStorage(StorageType type) {
+	switch (type) {
+	case StorageType::Hash:
+		return std::make_unique<HashCellStorage>();
+	case StorageType::Tiled:
+		return std::make_unique<TiledCellStorage>();
+	case StorageType::FlatHash:
+		return std::make_unique<FlatHashCellStorage>();
+	}
+	return nullptr;
+}
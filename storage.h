@@ -0,0 +1,60 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+
+class Cell;
+
+// Тип хранилища ячеек листа
+enum class StorageType {
+	Hash,      // разреженная хэш-таблица: по узлу на ячейку
+	Tiled,     // блоки 64x64, выделяемые по требованию
+	FlatHash,  // разреженная хэш-таблица с открытой адресацией, без узлов
+};
+
+// Хэш-функция для Position — требуется для использования в unordered_map.
+// Биты не перемешиваются: unordered_map берёт остаток от деления на простое
+// число корзин, а соседние ячейки остаются в соседних корзинах.
+// Для таблиц со степенью двойки слотов не годится (см. FlatHashCellStorage)
+struct PositionHash {
+	size_t operator()(const Position& pos) const {
+		// Комбинируем row и col через битовый сдвиг.
+		return static_cast<size_t>(pos.row) ^
+			(static_cast<size_t>(pos.col) << 16);
+	}
+};
+
+/*
+ * Хранилище ячеек листа.
+ * Владеет объектами Cell; адрес ячейки не меняется до её удаления,
+ * поэтому на ячейки можно ссылаться сырыми указателями (граф зависимостей).
+ * Позиции, передаваемые в методы, должны быть корректными.
+ */
+class CellStorage {
+public:
+	using Visitor = std::function<void(Position, Cell&)>;
+
+	virtual ~CellStorage() = default;
+
+	// Возвращает ячейку по позиции либо nullptr, если её нет
+	virtual Cell* Find(Position pos) const = 0;
+
+	// Возвращает существующую ячейку или создаёт новую пустую
+	virtual Cell* Emplace(Position pos) = 0;
+
+	// Удаляет ячейку. Возвращает false, если ячейки не было
+	virtual bool Erase(Position pos) = 0;
+
+	// Обходит все существующие ячейки в неопределённом порядке
+	virtual void ForEach(const Visitor& visit) const = 0;
+
+	// Обходит существующие ячейки диапазона по строкам, слева направо.
+	// Диапазон должен быть корректным
+	virtual void ForEachInRange(CellRange range, const Visitor& visit) const = 0;
+};
+
+// Создаёт пустое хранилище указанного типа
+std::unique_ptr<CellStorage> CreateCellStorage(StorageType type);
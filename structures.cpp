@@ -1,12 +1,8 @@
 #include "common.h"
 
-#include <cctype>
+#include <algorithm>
 #include <sstream>
 
-const int LETTERS = 26;
-const int MAX_POSITION_LENGTH = 17;
-const int MAX_POS_LETTER_COUNT = 3;
-
 const Position Position::NONE = { -1, -1 };
 
 /*
@@ -58,110 +54,63 @@ bool Position::IsValid() const {
 }
 
 std::string Position::ToString() const {
-	if (!IsValid()) {
-		return "";
-	}
-
-	std::string result;
-	int col = this->col;
-	while (col >= 0) {
-		result = char('A' + col % LETTERS) + result;
-		col = col / LETTERS - 1;
-	}
-	return result + std::to_string(row + 1);
+	char buffer[MAX_STRING_SIZE];
+	return std::string(buffer, ToChars(buffer));
 }
 
-namespace {
-
-	// Разбивает текстовое представление адреса ячейки на представление столбца и строки
-	std::pair<std::string_view, std::string_view> SplitCellIndex(const std::string_view& str) {
-		size_t col_end = 0;
-		while (col_end < str.size() && std::isalpha(str[col_end])) {
-			++col_end;
-		}
-
-		if (col_end == 0 || col_end == str.size()) {
-			return { std::string_view(), std::string_view() };
-		}
-
-		return { str.substr(0, col_end), str.substr(col_end) };
-	}
-
-	// Проверяет корректность представления столбца и возвращает номер столбца
-	// При ошибке возвращает -1
-	int ColumnIndexToInt(const std::string_view& col_str) {
-		if (col_str.empty() || col_str.size() > 3) {
-			return -1;
-		}
-
-		int col = 0;
-		for (char c : col_str) {
-			if (c < 'A' || c > 'Z') {
-				return -1;
-			}
-			col = col * LETTERS + (c - 'A' + 1);
-		}
-
-		col -= 1;
+Position Position::FromString(std::string_view str) {
+	return FromChars(str);
+}
 
-		if (col >= Position::MAX_COLS) {
-			return -1;
-		}
+// Преобразования вычислимы при компиляции
+static_assert(Position::FromChars("A1").Pack() == Position{ 0, 0 }.Pack());
+static_assert(Position::FromChars("XFD16384").Pack() == Position{ 16383, 16383 }.Pack());
+static_assert(Position::FromChars("XFE1").row == -1 && Position::FromChars("A01").row == -1);
+static_assert(Position::Unpack(Position{ 5, 7 }.Pack()).col == 7);
 
-		return col;
-	}
+bool Size::operator==(Size rhs) const {
+	return cols == rhs.cols && rows == rhs.rows;
+}
 
-	// Проверяет корректность представления строки и возвращает её номер
-	// При ошибке возвращает -1
-	int RowIndexToInt(const std::string_view& row_str) {
-		if (row_str.empty() || row_str[0] == '0') {
-			return -1;
-		}
-
-		for (char c : row_str) {
-			if (!std::isdigit(c)) {
-				return -1;
-			}
-		}
-
-		try {
-			int row = std::stoi(std::string(row_str)) - 1;
-			if (row < 0 || row >= Position::MAX_ROWS) {
-				return -1;
-			}
-			return row;
-		}
-		catch (...) {
-			return -1;
-		}
-	}
+/*
+ * Реализация структуры CellRange
+ */
 
-} // namespace
+bool CellRange::operator==(CellRange rhs) const {
+	return first == rhs.first && last == rhs.last;
+}
 
-Position Position::FromString(std::string_view str) {
-	// Проверка на минимальную длину
-	if (str.size() < 2) {
-		return Position::NONE;
+bool CellRange::operator<(CellRange rhs) const {
+	if (!(first == rhs.first)) {
+		return first < rhs.first;
 	}
+	return last < rhs.last;
+}
 
-	// Разбивка на столбец и строку
-	auto [col_str, row_str] = SplitCellIndex(str);
-
-	if (col_str.empty() || row_str.empty()) {
-		return Position::NONE;
-	}
+bool CellRange::IsValid() const {
+	return first.IsValid() && last.IsValid()
+		&& first.row <= last.row && first.col <= last.col;
+}
 
-	// Преобразование в числа
-	int col = ColumnIndexToInt(col_str);
-	int row = RowIndexToInt(row_str);
+bool CellRange::Contains(Position pos) const {
+	return pos.row >= first.row && pos.row <= last.row
+		&& pos.col >= first.col && pos.col <= last.col;
+}
 
-	if (col == -1 || row == -1) {
-		return Position::NONE;
+std::string CellRange::ToString() const {
+	if (!IsValid()) {
+		return "";
 	}
-
-	return { row, col };
+	char buffer[Position::MAX_STRING_SIZE * 2 + 1];
+	size_t size = first.ToChars(buffer);
+	buffer[size++] = ':';
+	size += last.ToChars(buffer + size);
+	return std::string(buffer, size);
 }
 
-bool Size::operator==(Size rhs) const {
-	return cols == rhs.cols && rows == rhs.rows;
-}
\ No newline at end of file
+CellRange CellRange::FromCorners(Position lhs, Position rhs) {
+	return {
+		{ std::min(lhs.row, rhs.row), std::min(lhs.col, rhs.col) },
+		{ std::max(lhs.row, rhs.row), std::max(lhs.col, rhs.col) },
+	};
+}
@@ -0,0 +1,44 @@
+#include "text_pool.h"
+
+#include <cassert>
+#include <utility>
+
+TextPool::~TextPool() {
+	// Записи удаляются вместе с ячейками, которые их держат
+	assert(entries_.empty());
+}
+
+TextPool::Entry* TextPool::Acquire(std::string_view text) {
+	const auto it = entries_.find(text);
+	if (it == entries_.end()) {
+		return nullptr;
+	}
+	++it->second->refs;
+	return it->second;
+}
+
+TextPool::Entry* TextPool::Insert(std::string text, FormulaInterface::Value number) {
+	Entry* entry = MakeEntry(std::move(text), number);
+	entry->pool = this;
+	[[maybe_unused]] const bool inserted = entries_.emplace(entry->text, entry).second;
+	assert(inserted);
+	return entry;
+}
+
+size_t TextPool::GetSize() const {
+	return entries_.size();
+}
+
+TextPool::Entry* TextPool::MakeEntry(std::string text, FormulaInterface::Value number) {
+	return new Entry{ std::move(text), number };
+}
+
+void TextPool::Release(Entry* entry) {
+	if (--entry->refs > 0) {
+		return;
+	}
+	if (entry->pool) {
+		entry->pool->entries_.erase(entry->text);
+	}
+	delete entry;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "formula.h"
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+/*
+ * Таблица текстов ячеек листа (интернирование).
+ * В листах с повторяющимися подписями (коды, категории, названия стран)
+ * одинаковые тексты хранятся один раз: ячейки ссылаются на общую запись
+ * со счётчиком ссылок, и запись удаляется вместе с последней ссылкой.
+ * Одинаковым текстам таблицы соответствует одна запись, поэтому
+ * сравнивать их можно по указателю.
+ *
+ * Таблица должна пережить свои записи. Записи берутся и освобождаются
+ * только при изменении листа, поэтому синхронизации нет
+ */
+class TextPool {
+public:
+	// Текст и его значение как операнда формулы
+	struct Entry {
+		std::string text;
+		FormulaInterface::Value number;
+		TextPool* pool = nullptr;  // nullptr — запись вне таблицы
+		size_t refs = 1;
+	};
+
+	TextPool() = default;
+	TextPool(const TextPool&) = delete;
+	TextPool& operator=(const TextPool&) = delete;
+	~TextPool();
+
+	// Возвращает запись с текстом text, увеличив её счётчик ссылок,
+	// либо nullptr, если такой записи нет
+	Entry* Acquire(std::string_view text);
+
+	// Добавляет запись с одной ссылкой. Текста text в таблице быть не должно
+	Entry* Insert(std::string text, FormulaInterface::Value number);
+
+	// Число различных текстов в таблице
+	size_t GetSize() const;
+
+	// Создаёт запись вне таблицы с одной ссылкой
+	static Entry* MakeEntry(std::string text, FormulaInterface::Value number);
+
+	// Уменьшает счётчик ссылок; запись без ссылок удаляется (и из таблицы)
+	static void Release(Entry* entry);
+
+private:
+	// Ключ — текст самой записи: он не меняется, пока запись жива
+	std::unordered_map<std::string_view, Entry*> entries_;
+};
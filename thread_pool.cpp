@@ -0,0 +1,119 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(size_t thread_count) {
+	thread_count = std::max<size_t>(thread_count, 1);
+	queues_.reserve(thread_count);
+	for (size_t i = 0; i < thread_count; ++i) {
+		queues_.push_back(std::make_unique<Queue>());
+	}
+	workers_.reserve(thread_count - 1);
+	for (size_t i = 1; i < thread_count; ++i) {
+		workers_.emplace_back([this, i] { WorkerLoop(i); });
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard lock(mutex_);
+		stop_ = true;
+	}
+	wake_.notify_all();
+	for (auto& worker : workers_) {
+		worker.join();
+	}
+}
+
+size_t ThreadPool::GetThreadCount() const {
+	return queues_.size();
+}
+
+void ThreadPool::ParallelFor(size_t task_count, const std::function<void(size_t)>& task) {
+	if (workers_.empty() || task_count <= 1) {
+		for (size_t i = 0; i < task_count; ++i) {
+			task(i);
+		}
+		return;
+	}
+
+	// Раздаём задачи непрерывными отрезками: соседние задачи обычно
+	// работают с соседними данными
+	const size_t thread_count = queues_.size();
+	for (size_t q = 0; q < thread_count; ++q) {
+		const size_t begin = task_count * q / thread_count;
+		const size_t end = task_count * (q + 1) / thread_count;
+		std::lock_guard lock(queues_[q]->mutex);
+		for (size_t i = begin; i < end; ++i) {
+			queues_[q]->tasks.push_back(i);
+		}
+	}
+
+	{
+		std::lock_guard lock(mutex_);
+		task_ = &task;
+		active_workers_ = workers_.size();
+		++generation_;
+	}
+	wake_.notify_all();
+
+	RunTasks(0);
+
+	// Рабочие потоки могут ещё выполнять перехваченные задачи
+	std::unique_lock lock(mutex_);
+	done_.wait(lock, [this] { return active_workers_ == 0; });
+	task_ = nullptr;
+}
+
+void ThreadPool::WorkerLoop(size_t index) {
+	uint64_t seen_generation = 0;
+	while (true) {
+		{
+			std::unique_lock lock(mutex_);
+			wake_.wait(lock, [&] { return stop_ || generation_ != seen_generation; });
+			if (stop_) {
+				return;
+			}
+			seen_generation = generation_;
+		}
+
+		RunTasks(index);
+
+		std::lock_guard lock(mutex_);
+		if (--active_workers_ == 0) {
+			done_.notify_one();
+		}
+	}
+}
+
+void ThreadPool::RunTasks(size_t index) {
+	size_t task;
+	while (PopOwn(index, task) || Steal(index, task)) {
+		(*task_)(task);
+	}
+}
+
+bool ThreadPool::PopOwn(size_t index, size_t& task) {
+	Queue& queue = *queues_[index];
+	std::lock_guard lock(queue.mutex);
+	if (queue.tasks.empty()) {
+		return false;
+	}
+	task = queue.tasks.front();
+	queue.tasks.pop_front();
+	return true;
+}
+
+bool ThreadPool::Steal(size_t thief, size_t& task) {
+	const size_t thread_count = queues_.size();
+	for (size_t offset = 1; offset < thread_count; ++offset) {
+		Queue& queue = *queues_[(thief + offset) % thread_count];
+		std::lock_guard lock(queue.mutex);
+		if (!queue.tasks.empty()) {
+			task = queue.tasks.back();
+			queue.tasks.pop_back();
+			return true;
+		}
+	}
+	return false;
+}
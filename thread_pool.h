@@ -0,0 +1,64 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Пул потоков с перехватом работы (work stealing).
+ * Задачи пакета раздаются по очередям потоков непрерывными отрезками;
+ * поток берёт задачи из начала своей очереди, а опустошив её,
+ * забирает задачи с конца чужих очередей.
+ * Вызывающий поток участвует в выполнении наравне с рабочими.
+ */
+class ThreadPool {
+public:
+	// thread_count — общее число потоков, включая вызывающий
+	explicit ThreadPool(size_t thread_count);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	size_t GetThreadCount() const;
+
+	// Выполняет task(i) для каждого i из [0, task_count) и дожидается
+	// завершения всех задач. Задачи не должны бросать исключений.
+	// Вызовы ParallelFor не должны пересекаться во времени
+	void ParallelFor(size_t task_count, const std::function<void(size_t)>& task);
+
+private:
+	struct Queue {
+		std::mutex mutex;
+		std::deque<size_t> tasks;
+	};
+
+	void WorkerLoop(size_t index);
+
+	// Выполняет задачи своей очереди, затем чужих, пока все очереди не опустеют
+	void RunTasks(size_t index);
+
+	bool PopOwn(size_t index, size_t& task);
+	bool Steal(size_t thief, size_t& task);
+
+private:
+	// Очередь i принадлежит потоку i; очередь 0 — вызывающему потоку
+	std::vector<std::unique_ptr<Queue>> queues_;
+	std::vector<std::thread> workers_;
+
+	// Текущий пакет задач; действителен, пока идёт ParallelFor
+	const std::function<void(size_t)>* task_ = nullptr;
+
+	std::mutex mutex_;
+	std::condition_variable wake_;
+	std::condition_variable done_;
+	uint64_t generation_ = 0;
+	size_t active_workers_ = 0;
+	bool stop_ = false;
+};